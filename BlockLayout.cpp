@@ -0,0 +1,290 @@
+#include <unordered_map>
+#include <algorithm>
+
+#include "BlockLayout.h"
+
+using namespace std;
+
+// @input commands: one function (starting with C_FUNCTION) or top-level code
+// @input profile: execution profile, nullptr to estimate from the loops
+BlockLayout::BlockLayout(vector<VMCommand> &commands, Profile *profile) : commands(commands) {
+  this->profile = profile;
+  this->fallsOff = false;
+}
+
+// @return the commands in the new block order, or unchanged if the
+//   function can't be laid out (duplicated labels, jumps out of it); a goto
+//   added for a fall-through keeps the line and text of the command before it
+vector<VMCommand> BlockLayout::getCommands() {
+  if (!findBlocks()) return commands;
+  threadJumps();
+  if (profile == nullptr || !findFrequencies()) estimateFrequencies();
+  vector<int> order = findOrder();
+
+  // which blocks get a new jump to them and need a label
+  vector<bool> needsLabel(blocks.size(), false);
+  for (size_t i = 0; i < order.size(); i++) {
+    Block &block = blocks[order[i]];
+    int placedNext = (i + 1 < order.size()) ? order[i + 1] : -1;
+    if (block.next != -1 && block.next != placedNext) needsLabel[block.next] = true;
+  }
+
+  vector<VMCommand> laidOut;
+  for (size_t i = 0; i < order.size(); i++) {
+    Block &block = blocks[order[i]];
+    int placedNext = (i + 1 < order.size()) ? order[i + 1] : -1;
+    if (needsLabel[order[i]] && block.label.empty()) {
+      laidOut.push_back({"C_LABEL", getLabel(order[i]), 0, "", commands[block.begin].line, -1, false, true});
+    }
+    for (int c = block.begin; c < block.end - 1; c++) {
+      laidOut.push_back(commands[c]);
+    }
+
+    VMCommand last = commands[block.end - 1];
+    if (last.type == "C_GOTO" || last.type == "C_IF") {
+      last.arg1 = getLabel(block.taken); // may have been threaded
+    }
+    if (last.type == "C_GOTO") {
+      if (block.taken != placedNext) laidOut.push_back(last); // else jump to next: removed
+    } else if (last.type == "C_IF") {
+      if (block.next == placedNext || block.next == -1) { // -1: falls off the end
+        laidOut.push_back(last);
+      } else if (block.taken == placedNext) { // jump to the fall-through block if false
+        last.type = "C_IFNOT";
+        last.arg1 = getLabel(block.next);
+        laidOut.push_back(last);
+      } else {
+        laidOut.push_back(last);
+        laidOut.push_back({"C_GOTO", getLabel(block.next), 0, "", last.line, -1, false, true, last.text});
+      }
+    } else {
+      laidOut.push_back(last);
+      if (last.type != "C_RETURN" && block.next != -1 && block.next != placedNext) {
+        laidOut.push_back({"C_GOTO", getLabel(block.next), 0, "", last.line, -1, false, true, last.text});
+      }
+    }
+  }
+  return laidOut;
+}
+
+
+//--------Prvate--------
+
+// split the commands into basic blocks and link them
+// @return false if the blocks can't be reordered
+bool BlockLayout::findBlocks() {
+  int begin = 0;
+  int size = commands.size();
+  for (int i = 0; i < size; i++) {
+    string type = commands[i].type;
+    if (type == "C_LABEL" && i > begin) {
+      blocks.push_back({begin, i, "", -1, -1, 0, 0, 0});
+      begin = i;
+    }
+    if (type == "C_GOTO" || type == "C_IF" || type == "C_RETURN") {
+      blocks.push_back({begin, i + 1, "", -1, -1, 0, 0, 0});
+      begin = i + 1;
+    }
+  }
+  if (begin < size) blocks.push_back({begin, size, "", -1, -1, 0, 0, 0});
+
+  unordered_map<string, int> labelToBlock;
+  for (size_t b = 0; b < blocks.size(); b++) {
+    VMCommand &first = commands[blocks[b].begin];
+    if (first.type == "C_LABEL") {
+      if (labelToBlock.count(first.arg1)) return false; // duplicated label
+      blocks[b].label = first.arg1;
+      labelToBlock[first.arg1] = b;
+    }
+  }
+
+  for (size_t b = 0; b < blocks.size(); b++) {
+    VMCommand &last = commands[blocks[b].end - 1];
+    if (last.type == "C_GOTO" || last.type == "C_IF") {
+      if (!labelToBlock.count(last.arg1)) return false; // jump out of the function
+      blocks[b].taken = labelToBlock[last.arg1];
+    }
+    if (last.type != "C_GOTO" && last.type != "C_RETURN") {
+      // the last block falls off the end: it has to stay last
+      if (b + 1 == blocks.size()) {
+        fallsOff = true;
+        continue;
+      }
+      blocks[b].next = b + 1;
+    }
+  }
+  return true;
+}
+
+// @return the block that a jump to block ends up in, skipping blocks that
+//   are only a goto (trampolines)
+int BlockLayout::getTrampolineTarget(int block) {
+  for (size_t hops = 0; hops < blocks.size(); hops++) {
+    Block &target = blocks[block];
+    VMCommand &first = commands[target.begin];
+    int size = target.end - target.begin;
+    bool onlyGoto = (size == 1 && first.type == "C_GOTO") ||
+                    (size == 2 && first.type == "C_LABEL" && commands[target.begin + 1].type == "C_GOTO");
+    // a counted label must still be reached
+    if (!onlyGoto || first.counter >= 0) return block;
+    block = target.taken;
+  }
+  return block; // loop of gotos
+}
+
+// let jumps and fall-throughs into a trampoline go to its target directly
+void BlockLayout::threadJumps() {
+  for (auto &block : blocks) {
+    if (block.taken != -1) block.taken = getTrampolineTarget(block.taken);
+    if (block.next != -1) block.next = getTrampolineTarget(block.next);
+  }
+}
+
+// read the execution count of every block and branch from the profile
+// @return false if the function wasn't executed in the profiled run
+bool BlockLayout::findFrequencies() {
+  long total = 0;
+  for (size_t b = 0; b < blocks.size(); b++) {
+    VMCommand &first = commands[blocks[b].begin];
+    long frequency = -1;
+    if (b == 0 && first.type == "C_FUNCTION") {
+      frequency = profile->getCount("function", first.site);
+    } else if (first.type == "C_LABEL") {
+      frequency = profile->getCount("label", first.site);
+    } else if (b > 0 && commands[blocks[b - 1].end - 1].type == "C_IF") {
+      frequency = profile->getNotTaken(commands[blocks[b - 1].end - 1].site);
+    }
+    blocks[b].frequency = max(frequency, 0L);
+    total += blocks[b].frequency;
+
+    VMCommand &last = commands[blocks[b].end - 1];
+    if (last.type == "C_IF") {
+      blocks[b].takenWeight = max(profile->getCount("branch", last.site), 0L);
+      blocks[b].nextWeight = max(profile->getNotTaken(last.site), 0L);
+    }
+  }
+  return total > 0;
+}
+
+// estimate the frequencies without a profile: every loop (a jump back to an
+// earlier block) runs 10 times, and an if-goto is taken 90% of the time when
+// it jumps back, 10% when it leaves the loop and 50% otherwise
+void BlockLayout::estimateFrequencies() {
+  vector<int> depth(blocks.size(), 0);
+  for (size_t b = 0; b < blocks.size(); b++) {
+    int head = blocks[b].taken;
+    if (head == -1 || head > (int) b) continue;
+    for (size_t inLoop = head; inLoop <= b; inLoop++) depth[inLoop]++;
+  }
+
+  for (size_t b = 0; b < blocks.size(); b++) {
+    Block &block = blocks[b];
+    block.frequency = 100;
+    for (int d = 0; d < min(depth[b], 4); d++) block.frequency *= 10;
+
+    if (commands[block.end - 1].type != "C_IF") continue;
+    long percentTaken = 50;
+    if (block.taken <= (int) b) {
+      percentTaken = 90;
+    } else if (depth[block.taken] < depth[b]) {
+      percentTaken = 10;
+    } else if (block.next != -1 && depth[block.next] < depth[b]) {
+      percentTaken = 90;
+    }
+    block.takenWeight = block.frequency * percentTaken / 100;
+    block.nextWeight = block.frequency - block.takenWeight;
+  }
+}
+
+// chain the blocks along the heaviest edges
+// @return the blocks in their new order, the first block stays first
+vector<int> BlockLayout::findOrder() {
+  int lastBlock = blocks.size() - 1;
+  vector<Edge> edges;
+  for (size_t b = 0; b < blocks.size(); b++) {
+    Block &block = blocks[b];
+    VMCommand &last = commands[block.end - 1];
+    // a last block that falls off the end has to stay the last one
+    if (fallsOff && (int) b == lastBlock) continue;
+    if (last.type == "C_IF") {
+      edges.push_back({(int) b, block.taken, block.takenWeight});
+      edges.push_back({(int) b, block.next, block.nextWeight});
+    } else if (block.taken != -1) {
+      edges.push_back({(int) b, block.taken, block.frequency});
+    } else if (block.next != -1) {
+      edges.push_back({(int) b, block.next, block.frequency});
+    }
+  }
+  // heaviest first; on a tie prefer back edges, so that a loop's condition
+  // is placed after its body and the loop needs no goto per iteration
+  stable_sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) {
+    if (a.weight != b.weight) return a.weight > b.weight;
+    return (a.to <= a.from) && !(b.to <= b.from);
+  });
+
+  // chains[c] = blocks of chain c, chainOf[b] = chain containing block b
+  vector<vector<int>> chains(blocks.size());
+  vector<int> chainOf(blocks.size());
+  for (size_t b = 0; b < blocks.size(); b++) {
+    chains[b] = {(int) b};
+    chainOf[b] = b;
+  }
+  for (auto &edge : edges) {
+    int from = chainOf[edge.from];
+    int to = chainOf[edge.to];
+    if (edge.to == 0 || from == to) continue;
+    // the chains of the first and the last block can't be one if other chains
+    // have to go between them
+    if (fallsOff && from == chainOf[0] && to == chainOf[lastBlock]) continue;
+    if (chains[from].back() != edge.from || chains[to].front() != edge.to) continue;
+    for (int b : chains[to]) {
+      chains[from].push_back(b);
+      chainOf[b] = from;
+    }
+    chains[to].clear();
+  }
+
+  // the chain of the first block, then the others in their original order
+  // (the chain of a last block that falls off the end at the end);
+  // blocks that can't be reached anymore (threaded trampolines) are dropped
+  vector<int> chainOrder = {chainOf[0]};
+  for (size_t c = 0; c < chains.size(); c++) {
+    if ((int) c == chainOf[0] || (fallsOff && (int) c == chainOf[lastBlock])) continue;
+    chainOrder.push_back(c);
+  }
+  if (fallsOff && chainOf[lastBlock] != chainOf[0]) chainOrder.push_back(chainOf[lastBlock]);
+
+  vector<bool> reachable = findReachable();
+  vector<int> order;
+  for (int c : chainOrder) {
+    for (int b : chains[c]) {
+      if (reachable[b] || (fallsOff && b == lastBlock)) order.push_back(b);
+    }
+  }
+  return order;
+}
+
+// @return which blocks can be reached from the first one
+vector<bool> BlockLayout::findReachable() {
+  vector<bool> reachable(blocks.size(), false);
+  vector<int> toVisit = {0};
+  reachable[0] = true;
+  while (!toVisit.empty()) {
+    Block &block = blocks[toVisit.back()];
+    toVisit.pop_back();
+    for (int successor : {block.taken, block.next}) {
+      if (successor != -1 && !reachable[successor]) {
+        reachable[successor] = true;
+        toVisit.push_back(successor);
+      }
+    }
+  }
+  return reachable;
+}
+
+// VM label of a block, made up for blocks without one (starting with a
+// digit, so that it can't be the label of a VM file)
+string BlockLayout::getLabel(int block) {
+  if (!blocks[block].label.empty()) return blocks[block].label;
+  return "0B" + to_string(block);
+}
@@ -0,0 +1,53 @@
+#include <string>
+#include <vector>
+
+#include "VMCommand.h"
+#include "Profile.h"
+
+using namespace std;
+
+#ifndef BLOCKLAYOUT_H
+#define BLOCKLAYOUT_H
+
+// reorders the basic blocks of one function so that the most frequent
+// edges fall through: chains are built from the heaviest edges first, then
+// gotos / if-gotos are fixed up (inverted, added or removed) for the new order.
+// The edge weights come from the profile if the function was executed in the
+// profiled run, else from the loop structure.
+class BlockLayout {
+public:
+  BlockLayout(vector<VMCommand> &commands, Profile *profile);
+  vector<VMCommand> getCommands();
+
+private:
+  struct Block {
+    int begin; // first command
+    int end; // one past the last command
+    string label; // VM label the block starts with, "" if none
+    int taken; // block jumped to by the last goto / if-goto, -1 if none
+    int next; // block reached by falling through, -1 if none
+    long frequency; // how many times the block was executed (or estimate)
+    long takenWeight; // how many times the last if-goto jumped
+    long nextWeight; // how many times the last if-goto fell through
+  };
+  struct Edge {
+    int from;
+    int to;
+    long weight;
+  };
+  vector<VMCommand> &commands;
+  Profile *profile;
+  vector<Block> blocks;
+  bool fallsOff; // whether the last block falls off the end (top-level code)
+
+  bool findBlocks();
+  int getTrampolineTarget(int block);
+  void threadJumps();
+  bool findFrequencies();
+  void estimateFrequencies();
+  vector<int> findOrder();
+  vector<bool> findReachable();
+  string getLabel(int block);
+};
+
+#endif
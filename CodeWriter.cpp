@@ -1,124 +1,660 @@
 #include <iostream>
 #include <fstream>
 #include <filesystem>
+#include <algorithm>
 
 #include "Parser.h"
 #include "CodeWriter.h"
+#include "BlockLayout.h"
+#include "StackDepth.h"
 
 using namespace std;
 namespace fs = std::filesystem;
 
-// @param outputFileName: asm_files/*.asm
-// open the output file stream
-CodeWriter::CodeWriter(string outputFileName, bool needSysInit) {
+// one CodeWriter (and its threads) can write any number of outputs, see open()
+// @input numThreads: threads translating functions, 1 for none, 0 for one
+//   per hardware thread
+CodeWriter::CodeWriter(int numThreads) {
+  this->needSysInit = false;
+  this->stats = nullptr;
+  this->profiling = false;
+  this->profile = nullptr;
+  this->lineNumber = 0;
+  this->compact = false;
+  this->sourceMap = false;
+  this->wholeFunction = true;
+  this->pool = new ThreadPool(numThreads > 0 ? numThreads : thread::hardware_concurrency());
+  this->out = &ofile;
+  this->messages = &cout;
+}
+
+CodeWriter::~CodeWriter() {
+  delete pool;
+}
+
+// start writing a new output, the settings are kept
+// @input outputFileName: path of the asm file, "-" for the standard output
+//   (then the messages go to the standard error)
+// @input needSysInit: whether the bootstrap code calls Sys.init
+// @return false if the file can't be opened
+bool CodeWriter::open(string outputFileName, bool needSysInit) {
+  this->outputFileName = outputFileName;
+  this->needSysInit = needSysInit;
   this->symbolRound = 0;
+  this->spOffset = 0;
+  this->clearPopped = true;
+  this->errorCount = 0;
+  this->romAddress = 0;
+  this->usedSharedCall = false;
+  this->usedSharedReturn = false;
+  this->counters.clear();
+  this->sourceEntries.clear();
+  this->part = 0;
   this->functionName = "";
-  setFileName(fs::path(outputFileName).stem().string());
+  setFileName("$bootstrap"); // namespace of the Sys.init call, can't be a file's
+
+  if (outputFileName == "-") {
+    this->out = &cout;
+    this->messages = &cerr;
+    return true;
+  }
   this->ofile.open(outputFileName);
-  ofile << getSPInitializeAssembly() << "\n";
+  this->out = &ofile;
+  this->messages = &cout;
+  if (!ofile.is_open()) {
+    cout << "Error: cannot write '" << outputFileName << "'." << endl;
+    return false;
+  }
+  return true;
+}
+
+// count emitted instructions and bytes into stats
+void CodeWriter::setStats(Stats *stats) {
+  this->stats = stats;
+}
+
+// insert profiling counters into the generated code: function entries,
+// call sites, label arrivals (loop iterations) and taken / not taken if-gotos
+// are counted at the top of the heap and the counter addresses are written
+// to <output>.prof.map by endWriting()
+void CodeWriter::setProfiling(bool profiling) {
+  this->profiling = profiling;
+}
+
+// use the execution profile of a previous run (see Profile::load):
+// - hot call sites and hot functions' returns are inlined, the others jump
+//   to one shared call / return routine; a function that doesn't fit in the
+//   ROM anymore shares its coldest ones too (without a profile every call
+//   and return is inlined)
+// - the blocks of profiled functions are reordered so that the likely
+//   path of each if-goto falls through (see BlockLayout; without a profile
+//   the likely paths are guessed from the loops)
+void CodeWriter::setProfile(Profile *profile) {
+  this->profile = profile;
+}
+
+// leave the comments and blank lines out of the assembly code
+void CodeWriter::setCompact(bool compact) {
+  this->compact = compact;
+}
+
+// write <output>.src.map (the VM file, line and command of each ROM address)
+// and <output>.cost (instructions per function and per VM line) by endWriting()
+void CodeWriter::setSourceMap(bool sourceMap) {
+  this->sourceMap = sourceMap;
+}
+
+// @input lineNumber: line of the next command in the current VM file
+void CodeWriter::setLineNumber(int lineNumber) {
+  this->lineNumber = lineNumber;
+}
+
+// write the bootstrap code: SP = 256 (and call Sys.init)
+void CodeWriter::writeInit() {
+  emit("BOOTSTRAP", getSPInitializeAssembly(), "bootstrap");
   if (needSysInit) {
     this->writeCall("Sys.init", 0);
+    writeCommands();
   }
 }
 
 // @input fileName: * (of vm_file/*.vm)
 // set the current file name
 void CodeWriter::setFileName(string fileName) {
+  writeCommands();
+  this->part = 0;
   this->fileName = fileName;
   this->functionName = "";
+  this->callSiteRound = 0;
+  this->branchRound = 0;
 }
 
 // @input command: arithmetic command ("add", "eq", etc.)
-// translate arithmetic code to assembly code
 void CodeWriter::writeArithmetic(string command) {
-  string assembly;
-  if (command == "add" || command == "sub") {
-    assembly = getAddSubAssembly(command);
-  } else if (command == "neg") {
-    assembly = getNegAssembly();
-  } else if (command == "and" || command == "or") {
-    assembly = getAndOrAssembly(command);
-  } else if (command == "not") {
-    assembly = getNotAssembly();
-  } else if (command == "eq" || command == "gt" || command == "lt") {
-    assembly = getEqGtLtAssembly(command);
-  } else {
-    cout << "invalid arithmetic command: " << command << endl;
-  }
-  ofile << assembly << "\n";
+  addCommand("C_ARITHMETIC", command, 0);
 }
 
-// translate pushcommand to assembly code
 void CodeWriter::writePush(string segment, int index) {
-  string assembly;
-  if (segment == "constant") {
-    assembly = getPushConstantAssembly(index);
-  } else if (segment == "static") {
-    assembly = getPushStaticAssembly(index);
-  } else {  // segment == "local", "argument", "this", "that", "pointer", "temp"
-    assembly = getPushSegmentAssembly(segment, index);
-  }
-  ofile << assembly << "\n";
+  addCommand("C_PUSH", segment, index);
 }
 
-// translate pop command to assembly code
 void CodeWriter::writePop(string segment, int index) {
-  string assembly;
-  if (segment == "static") {
-    assembly = getPopStaticAssembly(index);
-  } else {  // segment == "local", "argument", "this", "that", "pointer", "temp"
-    assembly = getPopSegmentAssembly(segment, index);
-  }
-  ofile << assembly << "\n";
+  addCommand("C_POP", segment, index);
 }
 
-// translate label command to assembly code
 void CodeWriter::writeLabel(string label) {
-  string assembly = getLabelAssembly(label);
-  ofile << assembly << "\n";
+  addCommand("C_LABEL", label, 0);
 }
 
-// translate goto command to assembly code
 void CodeWriter::writeGoto(string label) {
-  string assembly = getGotoAssembly(label);
-  ofile << assembly << "\n";
+  addCommand("C_GOTO", label, 0);
 }
 
-// translate if-goto command to assembly code
 void CodeWriter::writeIf(string label) {
-  string assembly = getIfAssembly(label);
-  ofile << assembly << "\n";
+  addCommand("C_IF", label, 0);
 }
 
-// translate (call f n) command to assembly code
 void CodeWriter::writeCall(string functionName, int numArgs) {
-  string assembly = getCallAssembly(functionName, numArgs);
-  ofile << assembly << "\n";
+  addCommand("C_CALL", functionName, numArgs);
 }
 
-// translate return command to assembly code
 void CodeWriter::writeReturn() {
-  string assembly = getReturnAssembly();
-  ofile << assembly << "\n";
+  addCommand("C_RETURN", "", 0);
 }
 
-// translate (function f k) command to assembly code
+// the previous function is complete: translate it, then start the new one
 void CodeWriter::writeFunction(string functionName, int numLocals) {
-  this->functionName = "";
-  string assembly = getFunctionAssembly(functionName, numLocals);
-  ofile << assembly << "\n";
+  writeCommands();
+  this->part = 0;
   this->functionName = functionName;
+  this->callSiteRound = 0;
+  this->branchRound = 0;
+  addCommand("C_FUNCTION", functionName, numLocals);
 }
 
-// close the streams
+// translate what is left and close the streams
 void CodeWriter::endWriting() {
-  ofile << getEndInfiniteLoopAssembly();
-  ofile.close();
+  writeCommands();
+  if (stats) stats->startTimer("wait for threads");
+  writeFinishedJobs(0);
+  if (stats) stats->stopTimer("wait for threads");
+  emit("END", getEndInfiniteLoopAssembly(), "end");
+  if (usedSharedCall) emit("C_CALL", getCallRoutineAssembly(), "$CALL");
+  if (usedSharedReturn) emit("C_RETURN", getReturnRoutineAssembly(), "$RETURN");
+  if (stats) stats->startTimer("flush");
+  if (out == &ofile) ofile.close();
+  else out->flush();
+  if (stats) stats->stopTimer("flush");
+  if (profiling && out == &ofile) {
+    writeProfileMap();
+  }
+  if (sourceMap && out == &ofile) {
+    writeSourceMap();
+  }
+}
+
+// @return whether the stack depth check found errors (printed by then)
+bool CodeWriter::hasErrors() {
+  return errorCount > 0;
+}
+
+// @return the lowest RAM address taken by the profiling counters
+int CodeWriter::getProfileBase() {
+  return PROFILE_END - COUNTER_WORDS * counters.size();
 }
 
 
 //--------Prvate--------
 
+// worker CodeWriter: translates one function of parent into its buffer
+CodeWriter::CodeWriter(CodeWriter *parent) {
+  this->symbolRound = 0;
+  this->spOffset = 0;
+  this->clearPopped = true;
+  this->errorCount = 0;
+  this->fileName = parent->fileName;
+  this->functionName = parent->functionName;
+  this->needSysInit = false;
+  this->stats = parent->stats ? new Stats() : nullptr;
+  this->profiling = parent->profiling;
+  this->profile = parent->profile;
+  this->romAddress = 0;
+  this->usedSharedCall = false;
+  this->usedSharedReturn = false;
+  this->lineNumber = 0;
+  this->compact = parent->compact;
+  this->sourceMap = parent->sourceMap;
+  this->part = parent->part;
+  this->wholeFunction = (parent->part == 0 && parent->commands.size() < MAX_COMMANDS);
+  this->pool = nullptr;
+  this->out = &buffer;
+  this->messages = parent->messages;
+}
+
+// buffer a command of the current function, with its name in the profile
+// and its profiling counters
+void CodeWriter::addCommand(string type, string arg1, int arg2) {
+  VMCommand command;
+  command.type = type;
+  command.arg1 = arg1;
+  command.arg2 = arg2;
+  command.line = this->lineNumber;
+  command.counter = -1;
+  command.inlined = true;
+  command.clearsSlot = true;
+  command.text = getCommandText(command);
+  if (type == "C_FUNCTION") {
+    command.site = arg1;
+  } else if (type == "C_LABEL") {
+    command.site = getLabelSymbol(arg1);
+  } else if (type == "C_IF") {
+    command.site = getLabelSymbol(arg1) + "#" + to_string(this->branchRound++);
+  } else if (type == "C_CALL") {
+    string caller = this->functionName.empty() ? this->fileName : this->functionName;
+    command.site = caller + "#" + to_string(this->callSiteRound++) + "->" + arg1;
+  }
+
+  if (profiling && type == "C_IF") {
+    // taken at counter, not taken at counter - COUNTER_WORDS
+    command.counter = allocateCounter("taken", command.site);
+    if (command.counter >= 0 && allocateCounter("nottaken", command.site) < 0) command.counter = -1;
+  } else if (profiling && (type == "C_FUNCTION" || type == "C_LABEL" || type == "C_CALL")) {
+    string kind = (type == "C_FUNCTION") ? "function" : (type == "C_LABEL") ? "label" : "call";
+    command.counter = allocateCounter(kind, command.site);
+  }
+  commands.push_back(command);
+
+  // a very long function is translated in parts, to bound the memory
+  if (commands.size() >= MAX_COMMANDS) {
+    writeCommands();
+  }
+}
+
+// hand the buffered commands of the current function (or top-level code)
+// to the thread pool; the translated functions are written in their order,
+// and no more than MAX_JOBS of them wait for a thread or to be written
+void CodeWriter::writeCommands() {
+  if (commands.empty()) return;
+  planCommands();
+  Job *job = new Job();
+  job->writer = new CodeWriter(this);
+  job->writer->commands = move(commands);
+  job->done = false;
+  jobs.push_back(job);
+  commands.clear();
+  part++;
+
+  pool->submit([this, job]() {
+    job->writer->translateCommands();
+    lock_guard<mutex> guard(jobsLock);
+    job->done = true;
+    jobFinished.notify_all();
+  });
+  writeFinishedJobs(MAX_JOBS);
+}
+
+// decide which calls and returns are inlined: without a profile all of them,
+// with a profile only the hot ones (fitInROM shares more of them if needed)
+void CodeWriter::planCommands() {
+  if (profile == nullptr) return; // all inlined (command.inlined is true)
+  for (auto &command : commands) {
+    if (command.type == "C_CALL") {
+      command.inlined = profile->isHot("call", command.site);
+      if (!command.inlined) usedSharedCall = true;
+    } else if (command.type == "C_RETURN") {
+      command.inlined = profile->isHot("function", this->functionName);
+      if (!command.inlined) usedSharedReturn = true;
+    }
+  }
+}
+
+// translate the buffered commands (run by a worker thread)
+void CodeWriter::translateCommands() {
+  // the whole-function passes are left out for the parts of a long function
+  if (wholeFunction) {
+    if (stats) stats->startTimer("layout");
+    BlockLayout layout(commands, profile);
+    commands = layout.getCommands();
+    if (stats) stats->stopTimer("layout");
+
+    if (stats) stats->startTimer("stack depth");
+    StackDepth depth(commands, fileName);
+    if (depth.verify()) {
+      depth.elideClears();
+    } else {
+      errors = depth.getErrors();
+    }
+    if (stats) stats->stopTimer("stack depth");
+  }
+  generateCode();
+  // with a profile, fitInROM may need the commands to translate them again
+  if (profile == nullptr) commands.clear();
+}
+
+// translate the (laid out) commands into buffer, from the start
+void CodeWriter::generateCode() {
+  buffer.str("");
+  romAddress = 0;
+  sourceEntries.clear();
+  spOffset = 0;
+  symbolRound = 0;
+  for (auto &command : commands) {
+    if (!stats) {
+      writeCommand(command);
+      continue;
+    }
+    // an inverted if-goto counts as an if-goto, as in emit()
+    string phase = "codegen " + (command.type == "C_IFNOT" ? string("C_IF") : command.type);
+    stats->startTimer(phase);
+    writeCommand(command);
+    stats->stopTimer(phase);
+  }
+}
+
+// with a profile: if a translated function doesn't fit in the ROM after the
+// code written so far (leaving room for the end loop and the shared routines),
+// translate it again with its coldest inlined calls and returns shared (as
+// many more each round as the last round's saving says), until it fits or
+// none are left
+// @input writer: worker CodeWriter of the function, written next
+void CodeWriter::fitInROM(CodeWriter *writer) {
+  int reserved = countInstructions(getEndInfiniteLoopAssembly() + getCallRoutineAssembly() + getReturnRoutineAssembly());
+  if (romAddress + writer->romAddress + reserved <= ROM_SIZE) return;
+
+  // the inlined calls and returns, coldest first
+  vector<pair<long, VMCommand *>> inlined;
+  for (auto &command : writer->commands) {
+    if (!command.inlined) continue;
+    if (command.type == "C_CALL") {
+      inlined.push_back({profile->getCount("call", command.site), &command});
+    } else if (command.type == "C_RETURN") {
+      inlined.push_back({profile->getCount("function", writer->functionName), &command});
+    }
+  }
+  stable_sort(inlined.begin(), inlined.end(), [](const pair<long, VMCommand *> &a, const pair<long, VMCommand *> &b) {
+    return a.first < b.first;
+  });
+
+  size_t shared = 0;
+  int saving = 0; // instructions saved per shared command in the last round
+  while (shared < inlined.size() && romAddress + writer->romAddress + reserved > ROM_SIZE) {
+    int excess = romAddress + writer->romAddress + reserved - ROM_SIZE;
+    size_t end = min(shared + (saving > 0 ? (excess + saving - 1) / saving : 1), inlined.size());
+    int round = end - shared;
+    int before = writer->romAddress;
+    for (; shared < end; shared++) {
+      VMCommand *command = inlined[shared].second;
+      command->inlined = false;
+      if (command->type == "C_CALL") usedSharedCall = true;
+      else usedSharedReturn = true;
+    }
+    if (writer->stats) {
+      // count the emitted code of the last translation only
+      delete writer->stats;
+      writer->stats = new Stats();
+    }
+    writer->generateCode();
+    saving = (before - writer->romAddress) / round;
+  }
+}
+
+// write the translated functions at the front of the jobs to the output
+// @input maxJobs: wait until no more than maxJobs are left, 0 to wait for all
+void CodeWriter::writeFinishedJobs(size_t maxJobs) {
+  bool written = false;
+  while (!jobs.empty()) {
+    Job *job = jobs.front();
+    {
+      unique_lock<mutex> guard(jobsLock);
+      if (!job->done && jobs.size() <= maxJobs) break;
+      jobFinished.wait(guard, [job]() { return job->done; });
+    }
+    CodeWriter *writer = job->writer;
+    if (profile != nullptr) fitInROM(writer);
+    for (auto &error : writer->errors) {
+      *messages << error << endl;
+    }
+    errorCount += writer->errors.size();
+    *out << writer->buffer.str();
+    written = true;
+    for (auto entry : writer->sourceEntries) {
+      entry.address += romAddress;
+      sourceEntries.push_back(entry);
+    }
+    romAddress += writer->romAddress;
+    if (stats) {
+      stats->add(*writer->stats);
+      delete writer->stats;
+    }
+    delete writer;
+    delete job;
+    jobs.pop_front();
+  }
+  // pass the finished functions on right away when streaming
+  if (written && out != &ofile) out->flush();
+}
+
+// translate one command to assembly code
+void CodeWriter::writeCommand(VMCommand &command) {
+  string type = command.type;
+  string assembly;
+  clearPopped = command.clearsSlot;
+  if (type == "C_ARITHMETIC") {
+    string op = command.arg1;
+    if (op == "add" || op == "sub") {
+      assembly = getAddSubAssembly(op);
+    } else if (op == "neg") {
+      assembly = getNegAssembly();
+    } else if (op == "and" || op == "or") {
+      assembly = getAndOrAssembly(op);
+    } else if (op == "not") {
+      assembly = getNotAssembly();
+    } else if (op == "eq" || op == "gt" || op == "lt") {
+      assembly = getEqGtLtAssembly(op);
+    } else {
+      cout << "invalid arithmetic command: " << op << endl;
+    }
+  } else if (type == "C_PUSH") {
+    if (command.arg1 == "constant") {
+      assembly = getPushConstantAssembly(command.arg2);
+    } else if (command.arg1 == "static") {
+      assembly = getPushStaticAssembly(command.arg2);
+    } else {  // segment == "local", "argument", "this", "that", "pointer", "temp"
+      assembly = getPushSegmentAssembly(command.arg1, command.arg2);
+    }
+  } else if (type == "C_POP") {
+    if (command.arg1 == "static") {
+      assembly = getPopStaticAssembly(command.arg2);
+    } else {  // segment == "local", "argument", "this", "that", "pointer", "temp"
+      assembly = getPopSegmentAssembly(command.arg1, command.arg2);
+    }
+  } else if (type == "C_LABEL") {
+    assembly = getLabelAssembly(command.arg1, command.counter);
+  } else if (type == "C_GOTO") {
+    assembly = getGotoAssembly(command.arg1);
+  } else if (type == "C_IF") {
+    assembly = getIfAssembly(command.arg1, "JNE", command.counter);
+  } else if (type == "C_IFNOT") {
+    assembly = getIfAssembly(command.arg1, "JEQ", command.counter);
+  } else if (type == "C_CALL") {
+    if (command.inlined) {
+      assembly = getCallAssembly(command.arg1, command.arg2, command.counter);
+    } else {
+      assembly = getSharedCallAssembly(command.arg1, command.arg2, command.counter);
+    }
+  } else if (type == "C_RETURN") {
+    if (command.inlined) {
+      assembly = getReturnAssembly();
+    } else {
+      assembly = getSharedReturnAssembly();
+    }
+  } else if (type == "C_FUNCTION") {
+    assembly = getFunctionAssembly(command.arg1, command.arg2, command.counter);
+  }
+  if (&command == &commands.back()) {
+    // end of the function (or top-level code)
+    assembly += getCommitSPAssembly(0);
+  }
+  string location = "bootstrap";
+  if (command.line > 0) {
+    location = this->fileName + ".vm:" + to_string(command.line);
+  }
+  emit(type == "C_IFNOT" ? "C_IF" : type, assembly, location + " " + command.text);
+}
+
+// write the assembly of one command to the output file
+// @input source: "<file>:<line> <command>" the assembly was made from
+void CodeWriter::emit(string commandType, string assembly, string source) {
+  if (compact) {
+    assembly = removeComments(assembly);
+  } else {
+    assembly += "\n";
+  }
+  int instructions = countInstructions(assembly);
+  *out << assembly;
+
+  if (sourceMap && instructions > 0) {
+    string function = source.substr(0, source.find(" ")); // bootstrap, end loop, shared routines
+    if (source.find(".vm:") != string::npos) {
+      function = this->functionName.empty() ? this->fileName : this->functionName;
+    }
+    sourceEntries.push_back({romAddress, instructions, source, function});
+  }
+  romAddress += instructions;
+  if (stats != nullptr) {
+    stats->countEmitted(commandType, instructions, assembly.size());
+  }
+}
+
+// @return RAM address of a new profiling counter, -1 if the region is full
+int CodeWriter::allocateCounter(string kind, string name) {
+  if ((int) (counters.size() + 1) * COUNTER_WORDS > PROFILE_SIZE) {
+    *messages << "Error: more than " << PROFILE_SIZE / COUNTER_WORDS << " profiling counters, " << kind << " " << name << " is not counted" << endl;
+    return -1;
+  }
+  counters.push_back({kind, name});
+  return getProfileBase();
+}
+
+// increment the counter at RAM[address] (low word) and RAM[address + 1]
+// (high word), so that it doesn't wrap around after 65535; D is changed
+string CodeWriter::getCountAssembly(int address) {
+  if (address < 0) return "";
+  string counted = "$COUNT" + to_string(address);
+  string assembly = "// profile count\n";
+  assembly += "@" + to_string(address) + "\n";
+  assembly += "M=M+1\n";
+  assembly += "D=M\n";
+  assembly += "@" + counted + "\n";
+  assembly += "D;JNE\n";
+  assembly += "@" + to_string(address + 1) + "\n";
+  assembly += "M=M+1\n";
+  assembly += "(" + counted + ")\n";
+  return assembly;
+}
+
+// write "<address> <kind> <name>" for every counter next to the output file
+void CodeWriter::writeProfileMap() {
+  string mapFileName = fs::path(outputFileName).replace_extension(".prof.map").string();
+  ofstream mapFile(mapFileName);
+  mapFile << "// profiling counters of " << fs::path(outputFileName).filename().string() << ": RAM address, kind, name\n";
+  for (size_t i = 0; i < counters.size(); i++) {
+    mapFile << PROFILE_END - COUNTER_WORDS * (i + 1) << " " << counters[i].first << " " << counters[i].second << "\n";
+  }
+  mapFile.close();
+}
+
+// remove comments (whole lines or after an instruction) and blank lines
+string CodeWriter::removeComments(const string &assembly) {
+  string compacted;
+  size_t start = 0;
+  while (start < assembly.size()) {
+    size_t end = assembly.find('\n', start);
+    if (end == string::npos) end = assembly.size();
+    string line = assembly.substr(start, end - start);
+    line = line.substr(0, line.find("//"));
+    line.erase(line.find_last_not_of(" \t") + 1);
+    if (!line.empty()) compacted += line + "\n";
+    start = end + 1;
+  }
+  return compacted;
+}
+
+// the VM command as it is written in a VM file (before BlockLayout changes it)
+string CodeWriter::getCommandText(VMCommand &command) {
+  string type = command.type;
+  if (type == "C_ARITHMETIC") return command.arg1;
+  if (type == "C_PUSH") return "push " + command.arg1 + " " + to_string(command.arg2);
+  if (type == "C_POP") return "pop " + command.arg1 + " " + to_string(command.arg2);
+  if (type == "C_LABEL") return "label " + command.arg1;
+  if (type == "C_GOTO") return "goto " + command.arg1;
+  if (type == "C_IF") return "if-goto " + command.arg1;
+  if (type == "C_CALL") return "call " + command.arg1 + " " + to_string(command.arg2);
+  if (type == "C_RETURN") return "return";
+  return "function " + command.arg1 + " " + to_string(command.arg2);
+}
+
+// write the source map and the cost report next to the output file
+void CodeWriter::writeSourceMap() {
+  string mapFileName = fs::path(outputFileName).replace_extension(".src.map").string();
+  ofstream mapFile(mapFileName);
+  mapFile << "// source map of " << fs::path(outputFileName).filename().string()
+          << ": first ROM address, instructions, VM file:line, VM command\n";
+  for (auto &entry : sourceEntries) {
+    mapFile << entry.address << " " << entry.instructions << " " << entry.source << "\n";
+  }
+  mapFile.close();
+
+  // instructions per function and per VM line, in the order they were written
+  vector<pair<int, string>> functions, lines;
+  unordered_map<string, int> functionIndex, lineIndex;
+  for (auto &entry : sourceEntries) {
+    if (!functionIndex.count(entry.function)) {
+      functionIndex[entry.function] = functions.size();
+      functions.push_back({0, entry.function});
+    }
+    functions[functionIndex[entry.function]].first += entry.instructions;
+    if (entry.source.find(".vm:") == string::npos) continue;
+    if (!lineIndex.count(entry.source)) {
+      lineIndex[entry.source] = lines.size();
+      lines.push_back({0, entry.source});
+    }
+    lines[lineIndex[entry.source]].first += entry.instructions;
+  }
+
+  // most expensive first, functions then VM lines
+  auto moreExpensive = [](const pair<int, string> &a, const pair<int, string> &b) {
+    return a.first > b.first;
+  };
+  stable_sort(functions.begin(), functions.end(), moreExpensive);
+  stable_sort(lines.begin(), lines.end(), moreExpensive);
+
+  string costFileName = fs::path(outputFileName).replace_extension(".cost").string();
+  ofstream costFile(costFileName);
+  costFile << "// instructions per function\n";
+  for (auto &[cost, name] : functions) {
+    costFile << cost << " " << name << "\n";
+  }
+  costFile << "// instructions per VM line\n";
+  for (auto &[cost, name] : lines) {
+    costFile << cost << " " << name << "\n";
+  }
+  costFile.close();
+}
+
+// count the lines that are neither blank, comments nor labels
+int CodeWriter::countInstructions(const string &assembly) {
+  int count = 0;
+  size_t start = 0;
+  while (start < assembly.size()) {
+    size_t end = assembly.find('\n', start);
+    if (end == string::npos) end = assembly.size();
+    if (end > start && assembly[start] != '/' && assembly[start] != '(') count++;
+    start = end + 1;
+  }
+  return count;
+}
+
 string CodeWriter::getSPInitializeAssembly() {
   string assembly =
   "// set SP (RAM[0]) = 256\n"
@@ -129,18 +665,72 @@ string CodeWriter::getSPInitializeAssembly() {
   return assembly;
 }
 
-string CodeWriter::getDecrementSPAssembly() {
-  string assembly =
-  "// SP = SP - 1\n"
-  "@SP\n"
-  "M=M-1\n"
-  "\n"
-  "// RAM[SP] = 0\n"
-  "@0\n"
-  "D=A\n"
-  "@SP\n"
-  "A=M\n"
-  "M=D\n";
+// A = address of a stack slot (0 = the first free slot, -1 = the top value)
+// relative to the virtual SP (RAM[SP] + spOffset); if fold, one step of the
+// pending SP update is folded in (AM=M+1 / AM=M-1) when it goes the same way.
+// D is kept.
+string CodeWriter::getStackSlotAssembly(int slot, bool fold) {
+  int distance = spOffset + slot;
+  string assembly = "@SP\n";
+  if (fold && distance > 0 && spOffset > 0) {
+    assembly += "AM=M+1\n";
+    spOffset--;
+    distance--;
+  } else if (fold && distance < 0 && spOffset < 0) {
+    assembly += "AM=M-1\n";
+    spOffset++;
+    distance++;
+  } else if (distance > 0) {
+    assembly += "A=M+1\n";
+    distance--;
+  } else if (distance < 0) {
+    assembly += "A=M-1\n";
+    distance++;
+  } else {
+    assembly += "A=M\n";
+  }
+  for (; distance > 0; distance--) assembly += "A=A+1\n";
+  for (; distance < 0; distance++) assembly += "A=A-1\n";
+  return assembly;
+}
+
+// write the pending SP update to RAM[SP] (at the end of a basic block)
+// @input keep: part of the update left pending, for the next stack access to
+//   fold or pop right back
+string CodeWriter::getCommitSPAssembly(int keep) {
+  string assembly;
+  int update = spOffset - keep;
+  if (update == 0) return assembly;
+  assembly += "// SP = SP + " + to_string(update) + "\n";
+  if (update >= -2 && update <= 2) {
+    assembly += "@SP\n";
+    for (int i = 0; i < update; i++) assembly += "M=M+1\n";
+    for (int i = 0; i > update; i--) assembly += "M=M-1\n";
+  } else {
+    assembly += "@" + to_string(abs(update)) + "\n";
+    assembly += "D=A\n";
+    assembly += "@SP\n";
+    assembly += (update > 0) ? "M=M+D\n" : "M=M-D\n";
+  }
+  spOffset = keep;
+  return assembly;
+}
+
+// pop the top value into D, clearing its slot (RAM[SP] = 0 after a pop)
+// unless StackDepth found that it is written again anyway
+string CodeWriter::getPopToDAssembly() {
+  spOffset--;
+  string assembly = getStackSlotAssembly(0, true);
+  assembly += "D=M\n";
+  if (clearPopped) assembly += "M=0\n";
+  return assembly;
+}
+
+// push D
+string CodeWriter::getPushDAssembly() {
+  string assembly = getStackSlotAssembly(0, true);
+  assembly += "M=D\n";
+  spOffset++;
   return assembly;
 }
 
@@ -155,14 +745,16 @@ string CodeWriter::getEndInfiniteLoopAssembly() {
 
 string CodeWriter::getPushConstantAssembly(int x) {
   string assembly = "// push constant x\n";
+  if (x == 0 || x == 1) {
+    // no need to go through D
+    assembly += getStackSlotAssembly(0, true);
+    assembly += "M=" + to_string(x) + "\n";
+    spOffset++;
+    return assembly;
+  }
   assembly += "@" + to_string(x) + "\n";
-  assembly +=
-  "D=A\n"
-  "@SP\n"
-  "A=M\n"
-  "M=D\n"
-  "@SP\n"
-  "M=M+1\n";
+  assembly += "D=A\n";
+  assembly += getPushDAssembly();
   return assembly;
 }
 
@@ -172,75 +764,59 @@ string CodeWriter::getPushSegmentAssembly(string segment, int x) {
   if (segment == "local" || segment == "argument" || segment == "this" || segment == "that") {
     assembly += "@" + segToSymbol[segment] + "\n";
     assembly += "D=M\n";
-  } else if (segment == "pointer" || segment == "temp") {
-    if (segment == "pointer") assembly += "@3\n";
-    else assembly += "@5\n";
-    assembly += "D=A\n";
+    assembly += "@" + to_string(x) + "\n";
+    assembly += "A=D+A\n";
+  } else if (segment == "pointer") {
+    assembly += "@" + to_string(3 + x) + "\n";
+  } else if (segment == "temp") {
+    assembly += "@" + to_string(5 + x) + "\n";
   }
 
-  assembly += "@" + to_string(x) + "\n";
-  assembly += 
-  "A=D+A\n"
-  "D=M\n"
-  "@SP\n"
-  "A=M\n"
-  "M=D\n"
-  "@SP\n"
-  "M=M+1\n";
+  assembly += "D=M\n";
+  assembly += getPushDAssembly();
   return assembly;
 }
 
 string CodeWriter::getPopSegmentAssembly(string segment, int x) {
   string assembly = "// pop segment x\n";
 
-  if (segment == "local" || segment == "argument" || segment == "this" || segment == "that") {
-    assembly += "@" + segToSymbol[segment] + "\n";
-    assembly += "D=M\n";
-  } else if (segment == "pointer" || segment == "temp") {
-    if (segment == "pointer") assembly += "@3\n";
-    else assembly += "@5\n";
-    assembly += "D=A\n";
+  if (segment == "pointer" || segment == "temp") {
+    int address = (segment == "pointer") ? 3 + x : 5 + x;
+    assembly += getPopToDAssembly();
+    assembly += "@" + to_string(address) + "\n";
+    assembly += "M=D\n";
+    return assembly;
   }
 
+  // segment == "local", "argument", "this", "that"
+  assembly += "@" + segToSymbol[segment] + "\n";
+  assembly += "D=M\n";
   assembly += "@" + to_string(x) + "\n";
   assembly +=
   "D=D+A\n"
   "@R13\n"
-  "M=D\n"
-  "\n"
-  "@SP\n"
-  "A=M-1\n"
-  "D=M\n"
-  "\n"
+  "M=D\n";
+  assembly += getPopToDAssembly();
+  assembly +=
   "@R13\n"
   "A=M\n"
   "M=D\n";
-  assembly += "\n" + getDecrementSPAssembly();
   return assembly;
 }
 
 string CodeWriter::getPushStaticAssembly(int x) {
   string assembly = "// push static x\n";
   assembly += "@" + this->fileName + "." + to_string(x) + "\n";
-  assembly +=
-  "D=M\n"
-  "@SP\n"
-  "A=M\n"
-  "M=D\n"
-  "@SP\n"
-  "M=M+1\n";
+  assembly += "D=M\n";
+  assembly += getPushDAssembly();
   return assembly;
 }
 
 string CodeWriter::getPopStaticAssembly(int x) {
   string assembly = "// pop static x\n";
-  assembly +=
-  "@SP\n"
-  "A=M-1\n"
-  "D=M\n";
+  assembly += getPopToDAssembly();
   assembly += "@" + this->fileName + "." + to_string(x) + "\n";
   assembly += "M=D\n";
-  assembly += "\n" + getDecrementSPAssembly();
   return assembly;
 }
 
@@ -255,29 +831,18 @@ string CodeWriter::getAddSubAssembly(string command) {
   if (command == "add") assembly += "//add\n";
   else if (command == "sub") assembly += "//sub\n";
 
-  assembly +=
-  "@SP\n"
-  "A=M\n"
-  "A=A-1\n"
-  "D=M\n"
-  "A=A-1\n";
+  assembly += getPopToDAssembly();
+  assembly += "A=A-1\n";
 
-  if (command == "add") assembly += "D=M+D\n";
-  else if (command == "sub") assembly += "D=M-D\n";
-  else return "";
-
-  assembly += "M=D\n";
-  assembly += "\n" + getDecrementSPAssembly();
+  if (command == "add") assembly += "M=M+D\n";
+  else if (command == "sub") assembly += "M=M-D\n";
   return assembly;
 }
 
 string CodeWriter::getNegAssembly() {
-  string assembly =
-  "// neg\n"
-  "@SP\n"
-  "A=M\n"
-  "A=A-1\n"
-  "M=-M\n";
+  string assembly = "// neg\n";
+  assembly += getStackSlotAssembly(-1, true);
+  assembly += "M=-M\n";
   return assembly;
 }
 
@@ -293,38 +858,23 @@ string CodeWriter::getEqGtLtAssembly(string command) {
   else if (command == "gt") assembly += "//gt\n";
   else if (command == "lt") assembly += "//lt\n";
 
+  // x = true, then x = false unless x - y passes the test: no 0;JMP
+  // (no folding between the jump and its target, both paths must agree on SP)
+  string end = getSymbolPrefix() + "$END" + to_string(symbolRound);
+  assembly += getPopToDAssembly();
   assembly +=
-  "@SP\n"
-  "A=M\n"
-  "A=A-1\n"
-  "D=M\n"
   "A=A-1\n"
   "D=M-D\n"
-  "@" + this->fileName + ".TRUE" + to_string(symbolRound) + "\n";
+  "M=-1\n"
+  "@" + end + "\n";
 
   if (command == "eq") assembly += "D;JEQ\n";
   else if (command == "gt") assembly += "D;JGT\n";
   else if (command == "lt") assembly += "D;JLT\n";
-  else return "";
-  
-  assembly +=
-  "@" + this->fileName + ".FALSE" + to_string(symbolRound) + "\n"
-  "0;JMP\n"
-  "(" + this->fileName + ".TRUE" + to_string(symbolRound) + ")\n"
-  "@0\n"
-  "D=!A\n"
-  "@" + this->fileName + ".ENDIF" + to_string(symbolRound) + "\n"
-  "0;JMP\n"
-  "(" + this->fileName + ".FALSE" + to_string(symbolRound) + ")\n"
-  "@0\n"
-  "D=A\n"
-  "("+ this->fileName + ".ENDIF" + to_string(symbolRound) + ")\n"
-  "@SP\n"
-  "A=M\n"
-  "A=A-1\n"
-  "A=A-1\n"
-  "M=D\n";
-  assembly += "\n" + getDecrementSPAssembly();
+
+  assembly += getStackSlotAssembly(-1, false);
+  assembly += "M=0\n";
+  assembly += "(" + end + ")\n";
 
   symbolRound++;
   return assembly;
@@ -341,233 +891,306 @@ string CodeWriter::getAndOrAssembly(string command) {
   if (command == "and") assembly += "//and\n";
   else if (command == "or") assembly += "//or\n";
 
-  assembly +=
-  "@SP\n"
-  "A=M\n"
-  "A=A-1\n"
-  "D=M\n"
-  "A=A-1\n";
-
-  if (command == "and") assembly += "D=D&M\n";
-  else if (command == "or") assembly += "D=D|M\n";
+  assembly += getPopToDAssembly();
+  assembly += "A=A-1\n";
 
-  assembly += "M=D\n";
-  assembly += "\n" + getDecrementSPAssembly();
+  if (command == "and") assembly += "M=D&M\n";
+  else if (command == "or") assembly += "M=D|M\n";
   return assembly;
 }
 
 string CodeWriter::getNotAssembly() {
-  string assembly =
-  "//not\n"
-  "@SP\n"
-  "A=M\n"
-  "A=A-1\n"
-  "M=!M\n";
+  string assembly = "//not\n";
+  assembly += getStackSlotAssembly(-1, true);
+  assembly += "M=!M\n";
   return assembly;
 }
 
-string CodeWriter::getLabelAssembly(string label) {
-  string assembly = "// label xxx\n";
+// prefix of the internal symbols of the current function (or top-level code),
+// so that functions translated by different threads never share a symbol
+// (the parts of a long function are numbered)
+string CodeWriter::getSymbolPrefix() {
+  string prefix = this->functionName.empty() ? this->fileName : this->functionName;
+  if (part > 0) prefix += "$" + to_string(part);
+  return prefix;
+}
+
+// return the assembly symbol of a VM label in the current file & function
+string CodeWriter::getLabelSymbol(string label) {
   if (!this->functionName.empty()) {
-    assembly += "(" + this->fileName + "." + this->functionName + ".";
-  } else {
-    assembly += "(" + this->fileName + ".";
+    return this->fileName + "." + this->functionName + "." + label;
+  }
+  return this->fileName + "." + label;
+}
+
+// @input counter: RAM address of the label's counter, -1 for none
+string CodeWriter::getLabelAssembly(string label, int counter) {
+  string assembly = getCommitSPAssembly(0);
+  assembly += "// label xxx\n";
+  assembly += "(" + getLabelSymbol(label) + ")\n";
+  if (profiling) {
+    assembly += getCountAssembly(counter);
   }
-  assembly += label + ")\n";
   return assembly;
 }
 
 string CodeWriter::getGotoAssembly(string label) {
-  string assembly = "// goto xxx\n";
-  if (!this->functionName.empty()) {
-    assembly += "@" + this->fileName + "." + this->functionName + ".";
-  } else {
-    assembly += "@" + this->fileName + ".";
-  }
-  assembly += label + "\n";
+  string assembly = getCommitSPAssembly(0);
+  assembly += "// goto xxx\n";
+  assembly += "@" + getLabelSymbol(label) + "\n";
   assembly += "0;JMP\n";
   return assembly;
 }
 
-string CodeWriter::getIfAssembly(string label) {
-  string assembly = "//if-goto xxx \n";
-  assembly += 
-  "@SP\n"
-  "M=M-1\n"
-  "A=M\n"
-  "D=M\n"
-  "@R13\n"
-  "M=D\n"
-  "@0\n"
-  "D=A\n"
-  "@SP\n"
-  "A=M\n"
-  "M=D\n"
-  "@R13\n"
-  "D=M\n";
-  if (!this->functionName.empty()) {
-    assembly += "@" + this->fileName + "." + this->functionName + ".";
-  } else {
-    assembly += "@" + this->fileName + ".";
+// @input jump: "JNE" for if-goto, "JEQ" for an if-goto inverted by BlockLayout
+// @input counter: RAM address of the taken counter (not taken at
+//   counter - COUNTER_WORDS), -1 for none
+string CodeWriter::getIfAssembly(string label, string jump, int counter) {
+  // a value pushed just before is popped right back without an SP update,
+  // the rest of the update is committed; SP is up to date at the jump
+  string assembly = getCommitSPAssembly(spOffset > 0 ? 1 : 0);
+  assembly += "//if-goto xxx \n";
+  assembly += getPopToDAssembly();
+  if (profiling && counter >= 0) {
+    // count the jumping path in a stub, the other one before falling through
+    int jumped = (jump == "JNE") ? counter : counter - COUNTER_WORDS;
+    int fallen = (jump == "JNE") ? counter - COUNTER_WORDS : counter;
+    string stub = getSymbolPrefix() + "$PROFILE" + to_string(symbolRound);
+    assembly += "@" + stub + ".JUMP\n";
+    assembly += "D;" + jump + "\n";
+    assembly += getCountAssembly(fallen);
+    assembly += "@" + stub + ".END\n";
+    assembly += "0;JMP\n";
+    assembly += "(" + stub + ".JUMP)\n";
+    assembly += getCountAssembly(jumped);
+    assembly += "@" + getLabelSymbol(label) + "\n";
+    assembly += "0;JMP\n";
+    assembly += "(" + stub + ".END)\n";
+    symbolRound++;
+    return assembly;
   }
-  assembly += label + "\n";
-  assembly += "D;JNE\n";
+  assembly += "@" + getLabelSymbol(label) + "\n";
+  assembly += "D;" + jump + "\n";
   return assembly;
 }
 
-string CodeWriter::getFunctionAssembly(string functionName, int numLocal) {
+// @input counter: RAM address of the function's counter, -1 for none
+string CodeWriter::getFunctionAssembly(string functionName, int numLocal, int counter) {
   // f = functionName, k = numLocal
   string assembly = "// function f k\n";
   assembly += "(" + functionName + ")\n";
-  assembly += "@" + to_string(numLocal) + "\n";
+  if (profiling) {
+    assembly += getCountAssembly(counter);
+  }
+  for (int i = 0; i < numLocal; i++) {
+    assembly += getStackSlotAssembly(0, true);
+    assembly += "M=0\n";
+    spOffset++;
+  }
+  return assembly;
+}
+
+// @input counter: RAM address of the call site's counter, -1 for none
+string CodeWriter::getCallAssembly(string functionName, int numArgs, int counter) {
+  // f = functionName, n = numArgs
+  // one step of the pending SP update is left for the first push to fold
+  string assembly = getCommitSPAssembly(spOffset > 0 ? 1 : 0);
+  assembly += "// call f n\n";
+  if (profiling) {
+    assembly += getCountAssembly(counter);
+  }
+  assembly += "@" + getSymbolPrefix() + "$ret" + to_string(this->symbolRound) + "\n";
   assembly += "D=A\n";
+  assembly += getPushDAssembly();
+  for (string pointer : {"LCL", "ARG", "THIS", "THAT"}) {
+    assembly += "@" + pointer + "\n";
+    assembly += "D=M\n";
+    assembly += getPushDAssembly();
+  }
+  // the frame is complete: SP = LCL = SP + 1, ARG = SP - n - 5
   assembly +=
-  "@13\n"
+  "@SP\n"
+  "MD=M+1\n"
+  "@LCL\n"
   "M=D\n";
-  assembly += "(" + functionName + ".init.START)\n";
-  assembly +=
-  "@13\n"
-  "D=M\n";
-  assembly += "@" + functionName + ".init.END\n";
-  assembly += "D;JLE\n";
-  assembly += "\n" + getPushConstantAssembly(0) + "\n";
+  assembly += "@" + to_string(numArgs + 5) + "\n";
   assembly +=
-  "@13\n"
-  "M=M-1\n";
-  assembly += "@" + functionName + ".init.START\n";
+  "D=D-A\n"
+  "@ARG\n"
+  "M=D\n";
+  spOffset = 0;
+  assembly += "@" + functionName + "\n";
   assembly += "0;JMP\n";
-  assembly += "(" + functionName + ".init.END)\n";
+  assembly += "(" + getSymbolPrefix() + "$ret" + to_string(this->symbolRound) + ")\n";
+  this->symbolRound++;
   return assembly;
 }
 
-string CodeWriter::getCallAssembly(string functionName, int numArgs) {
-  // f = functionName, n = numArgs
-  string assembly = "// call f n\n";
-  assembly += "@Return" + to_string(this->symbolRound) + "\n";
-  assembly += "D=A\n";
-  assembly += "\n" + getPushConstantInD() + "\n";
+string CodeWriter::getReturnAssembly() {
+  string assembly = "// return\n";
   assembly +=
   "@LCL\n"
-  "D=M\n";
-  assembly += "\n" + getPushConstantInD() + "\n";
+  "D=M\n"
+  "@R14 // =FRAME\n"
+  "M=D\n"
+  "@5\n"
+  "A=D-A\n"
+  "D=M\n"
+  "@R15 // =RET\n"
+  "M=D\n";
+  // *ARG = pop(), SP = ARG + 1 (the pending SP update is dropped)
+  assembly += getPopToDAssembly();
   assembly +=
   "@ARG\n"
-  "D=M\n";
-  assembly += "\n" + getPushConstantInD() + "\n";
+  "A=M\n"
+  "M=D\n"
+  "D=A+1\n"
+  "@SP\n"
+  "M=D\n";
+  spOffset = 0;
+  for (string pointer : {"THAT", "THIS", "ARG", "LCL"}) {
+    assembly += "@R14\n";
+    assembly += "AM=M-1\n";
+    assembly += "D=M\n";
+    assembly += "@" + pointer + "\n";
+    assembly += "M=D\n";
+  }
   assembly +=
-  "@THIS\n"
-  "D=M\n";
-  assembly += "\n" + getPushConstantInD() + "\n";
+  "@R15\n"
+  "A=M // =RET\n"
+  "0;JMP\n";
+  return assembly;
+}
+
+// call f n through the shared routine: R13 = f, R14 = n, D = return address
+string CodeWriter::getSharedCallAssembly(string functionName, int numArgs, int counter) {
+  string assembly = getCommitSPAssembly(0);
+  assembly += "// call f n (shared)\n";
+  if (profiling) {
+    assembly += getCountAssembly(counter);
+  }
+  assembly += "@" + to_string(numArgs) + "\n";
   assembly +=
-  "@THAT\n"
-  "D=M\n";
-  assembly += "\n" + getPushConstantInD() + "\n";
+  "D=A\n"
+  "@R14\n"
+  "M=D\n";
+  assembly += "@" + functionName + "\n";
   assembly +=
-  "// ARG = SP - n - 5\n"
-  "@SP\n"
-  "D=M\n";
-  assembly += "\n" + getPushConstantInD();
-  assembly += "\n" + getPushConstantAssembly(numArgs + 5);
-  assembly += "\n" + getAddSubAssembly("sub") + "\n";
+  "D=A\n"
+  "@R13\n"
+  "M=D\n";
+  assembly += "@" + getSymbolPrefix() + "$ret" + to_string(this->symbolRound) + "\n";
+  assembly +=
+  "D=A\n"
+  "@$CALL\n"
+  "0;JMP\n";
+  assembly += "(" + getSymbolPrefix() + "$ret" + to_string(this->symbolRound) + ")\n";
+  this->symbolRound++;
+  return assembly;
+}
+
+string CodeWriter::getSharedReturnAssembly() {
+  string assembly = getCommitSPAssembly(0);
   assembly +=
+  "// return (shared)\n"
+  "@$RETURN\n"
+  "0;JMP\n";
+  return assembly;
+}
+
+// shared call routine, written once after the program
+string CodeWriter::getCallRoutineAssembly() {
+  string assembly =
+  "// shared call: push return address (D), LCL, ARG, THIS, THAT\n"
+  "($CALL)\n"
   "@SP\n"
-  "M=M-1\n"
   "A=M\n"
+  "M=D\n"
+  "@LCL\n"
   "D=M\n"
-  "@ARG\n"
+  "@SP\n"
+  "AM=M+1\n"
   "M=D\n"
-  "\n"
-  "@0\n"
-  "D=A\n"
+  "@ARG\n"
+  "D=M\n"
   "@SP\n"
-  "A=M\n"
+  "AM=M+1\n"
   "M=D\n"
-  "\n"
-  "// LCL = SP\n"
+  "@THIS\n"
+  "D=M\n"
   "@SP\n"
+  "AM=M+1\n"
+  "M=D\n"
+  "@THAT\n"
   "D=M\n"
+  "@SP\n"
+  "AM=M+1\n"
+  "M=D\n"
+  "// LCL = SP, ARG = SP - n - 5, goto f\n"
+  "@SP\n"
+  "MD=M+1\n"
   "@LCL\n"
-  "M=D\n";
-  assembly += "\n@" + functionName + "\n";
-  assembly += "0;JMP\n";
-  assembly += "(Return" + to_string(this->symbolRound) + ")\n";
-  this->symbolRound++;
+  "M=D\n"
+  "@R14\n"
+  "D=D-M\n"
+  "@5\n"
+  "D=D-A\n"
+  "@ARG\n"
+  "M=D\n"
+  "@R13\n"
+  "A=M\n"
+  "0;JMP\n";
   return assembly;
 }
 
-string CodeWriter::getReturnAssembly() {
-  string assembly = "// return\n";
-  assembly +=
+// shared return routine, written once after the program
+string CodeWriter::getReturnRoutineAssembly() {
+  string assembly =
+  "// shared return: FRAME = LCL, RET = *(FRAME - 5), *ARG = pop()\n"
+  "($RETURN)\n"
   "@LCL\n"
   "D=M\n"
   "@R14 // =FRAME\n"
-  "M=D\n";
-  assembly += "\n" + getPushConstantInD();
-  assembly += "\n" + getPushConstantAssembly(5);
-  assembly += "\n" + getAddSubAssembly("sub") + "\n";
-  assembly +=
-  "@SP\n"
-  "M=M-1\n"
-  "A=M\n"
-  "A=M\n"
+  "M=D\n"
+  "@5\n"
+  "A=D-A\n"
   "D=M\n"
   "@R15 // =RET\n"
   "M=D\n"
-  "@0\n"
-  "D=A\n"
   "@SP\n"
+  "AM=M-1\n"
+  "D=M\n"
+  "@ARG\n"
   "A=M\n"
-  "M=D\n";
-  assembly += "\n" + getPopSegmentAssembly("argument", 0) + "\n";
-  assembly +=
+  "M=D\n"
+  "// SP = ARG + 1, restore THAT, THIS, ARG, LCL, goto RET\n"
   "@ARG\n"
   "D=M+1\n"
   "@SP\n"
   "M=D\n"
-  "\n"
   "@R14\n"
-  "M=M-1\n"
-  "A=M\n"
+  "AM=M-1\n"
   "D=M\n"
   "@THAT\n"
   "M=D\n"
-  "\n"
   "@R14\n"
-  "M=M-1\n"
-  "A=M\n"
+  "AM=M-1\n"
   "D=M\n"
   "@THIS\n"
   "M=D\n"
-  "\n"
   "@R14\n"
-  "M=M-1\n"
-  "A=M\n"
+  "AM=M-1\n"
   "D=M\n"
   "@ARG\n"
   "M=D\n"
-  "\n"
   "@R14\n"
-  "M=M-1\n"
-  "A=M\n"
+  "AM=M-1\n"
   "D=M\n"
   "@LCL\n"
   "M=D\n"
-  "\n"
-  "@15\n"
-  "A=M // =RET\n"
-  "0;JMP\n";
-  return assembly;
-}
-
-
-string CodeWriter::getPushConstantInD() {
-  string assembly = "// push constant in D\n";
-  assembly +=
-  "@SP\n"
+  "@R15\n"
   "A=M\n"
-  "M=D\n"
-  "@SP\n"
-  "M=M+1\n";
+  "0;JMP\n";
   return assembly;
 }
 
@@ -1,4 +1,16 @@
 #include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#include "Stats.h"
+#include "Profile.h"
+#include "VMCommand.h"
+#include "ThreadPool.h"
 
 using namespace std;
 
@@ -15,7 +27,16 @@ using namespace std;
 
 class CodeWriter {
 public:
-  CodeWriter(string fileName, bool needSysInit);
+  CodeWriter(int numThreads);
+  ~CodeWriter();
+  bool open(string outputFileName, bool needSysInit);
+  void setStats(Stats *stats);
+  void setProfiling(bool profiling);
+  void setProfile(Profile *profile);
+  void setCompact(bool compact);
+  void setSourceMap(bool sourceMap);
+  void setLineNumber(int lineNumber);
+  void writeInit();
   void setFileName(string fileName);
   void writeArithmetic(string command);
   void writePush(string segment, int index);
@@ -27,17 +48,92 @@ public:
   void writeReturn();
   void writeFunction(string functionName, int numLocals);
   void endWriting();
+  bool hasErrors();
+  int getProfileBase();
+
+  // RAM region for profiling counters at the top of the heap: two words
+  // (low, high) per counter, taken downwards from PROFILE_END as needed
+  static const int PROFILE_END = 16384;
+  static const int PROFILE_SIZE = 4096;
+  static const int COUNTER_WORDS = 2;
+  static const int ROM_SIZE = 32768;
+  // memory bounds: commands buffered per function, functions in the pipeline
+  static const size_t MAX_COMMANDS = 1 << 16;
+  static const size_t MAX_JOBS = 64;
 
 private:
+  // a function being translated by a worker thread
+  struct Job {
+    CodeWriter *writer; // translates into writer->buffer
+    bool done;
+  };
+  // where an emitted piece of assembly code came from
+  struct SourceEntry {
+    int address; // first ROM address
+    int instructions;
+    string source; // "<file>.vm:<line> <command>", "bootstrap", "$CALL", etc.
+    string function;
+  };
+
   ofstream ofile; // output asm file
+  ostringstream buffer; // output of a worker CodeWriter
+  ostream *out; // &ofile, &cout when streaming, or &buffer for a worker CodeWriter
+  ostream *messages; // &cout, or &cerr when streaming
+  ThreadPool *pool; // translates the functions, nullptr for a worker CodeWriter
+  deque<Job *> jobs; // functions being translated, in output order
+  mutex jobsLock; // guards Job::done
+  condition_variable jobFinished;
+  string outputFileName; // path of the output asm file
+  bool needSysInit; // whether the bootstrap code calls Sys.init
+  Stats *stats; // translator stats, nullptr if --stats is not given
   string fileName; // current file that are being parsed
   string functionName; // current function, NULL if at top-level
-  int symbolRound; // for making internal symbols unique (for eq, gt, lt)
+  int spOffset; // pushes - pops not written to RAM[SP] yet in the current basic block
+  bool clearPopped; // whether the current command sets the slots it pops to 0
+  vector<string> errors; // of a worker CodeWriter, printed in order by the parent
+  int errorCount; // errors printed so far
+  int symbolRound; // for making internal symbols unique in the current function
+  int part; // parts of the current function already given to the pool
+  bool wholeFunction; // of a worker: whether it has a whole function (not a part)
+  int callSiteRound; // number of calls so far in the current function
+  int branchRound; // number of if-gotos so far in the current function
+  bool profiling; // whether profiling counters are inserted
+  vector<pair<string, string>> counters; // (kind, name) of RAM[PROFILE_END - COUNTER_WORDS * (i + 1)]
+  Profile *profile; // execution profile of a previous run, nullptr if none
+  int romAddress; // number of instructions written so far
+  bool usedSharedCall; // whether the shared call routine must be written
+  bool usedSharedReturn; // whether the shared return routine must be written
+  vector<VMCommand> commands; // commands of the current function, translated when it ends
+  int lineNumber; // line of the next command in the current VM file
+  bool compact; // whether comments and blank lines are left out
+  bool sourceMap; // whether the source map and cost report are written
+  vector<SourceEntry> sourceEntries; // for the source map and the cost report
   unordered_map<string, string> segToSymbol = {
     {"local", "LCL"}, {"argument", "ARG"}, {"this", "THIS"}, {"that", "THAT"}
   };
+  CodeWriter(CodeWriter *parent);
+  void addCommand(string type, string arg1, int arg2);
+  void writeCommands();
+  void planCommands();
+  void translateCommands();
+  void generateCode();
+  void fitInROM(CodeWriter *writer);
+  void writeFinishedJobs(size_t maxJobs);
+  void writeCommand(VMCommand &command);
+  void emit(string commandType, string assembly, string source);
+  int countInstructions(const string &assembly);
+  string removeComments(const string &assembly);
+  string getCommandText(VMCommand &command);
+  void writeSourceMap();
+  int allocateCounter(string kind, string name);
+  string getCountAssembly(int address);
+  void writeProfileMap();
+
   string getSPInitializeAssembly();
-  string getDecrementSPAssembly();
+  string getStackSlotAssembly(int slot, bool fold);
+  string getCommitSPAssembly(int keep);
+  string getPopToDAssembly();
+  string getPushDAssembly();
   string getEndInfiniteLoopAssembly();
   string getPushConstantAssembly(int x);
   string getPushSegmentAssembly(string segment, int x);
@@ -50,14 +146,19 @@ private:
   string getAndOrAssembly(string command);
   string getNotAssembly();
 
-  string getLabelAssembly(string label);
+  string getSymbolPrefix();
+  string getLabelSymbol(string label);
+  string getLabelAssembly(string label, int counter);
   string getGotoAssembly(string label);
-  string getIfAssembly(string label);
-  string getCallAssembly(string functionName, int numArgs);
+  string getIfAssembly(string label, string jump, int counter);
+  string getCallAssembly(string functionName, int numArgs, int counter);
   string getReturnAssembly();
-  string getFunctionAssembly(string functionName, int numLocalas);
+  string getSharedCallAssembly(string functionName, int numArgs, int counter);
+  string getSharedReturnAssembly();
+  string getCallRoutineAssembly();
+  string getReturnRoutineAssembly();
+  string getFunctionAssembly(string functionName, int numLocalas, int counter);
 
-  string getPushConstantInD();
   void setFunctionName(string functionName);
 };
 
@@ -1,5 +1,6 @@
 #include <iostream>
 #include <fstream>
+#include <algorithm>
 
 #include "Parser.h"
 
@@ -8,15 +9,24 @@ using namespace std;
 // open a file & prepare for parsing
 Parser::Parser(string fileName) {
   vmfile.open(fileName);
+  input = &vmfile;
+  currentLine = 0;
+}
+
+// parse a stream (e.g. cin) line by line, as it comes
+Parser::Parser(istream &input) {
+  this->input = &input;
+  currentLine = 0;
 }
 
 // return if there is any more commands left
 bool Parser::hasNextCommand() {
-  return !vmfile.eof();
+  return input->good();
 }
 
 void Parser::advance() {
-  getline(vmfile, currentCommand);
+  getline(*input, currentCommand);
+  currentLine++;
   currentCommand = currentCommand.substr(0, currentCommand.find("//"));
   currentCommand = removeLeadingSpaces(currentCommand);
 }
@@ -65,6 +75,11 @@ int Parser::arg2() {
   return arg2;
 }
 
+// return the line number of the current command
+int Parser::lineNumber() {
+  return currentLine;
+}
+
 void Parser::endParsing() {
   vmfile.close();
 }
@@ -1,4 +1,5 @@
 #include <fstream>
+#include <istream>
 
 using namespace std;
 
@@ -8,16 +9,20 @@ using namespace std;
 class Parser {
 public:
   Parser(string fileName);
+  Parser(istream &input);
   bool hasNextCommand();
   void advance();
   string commandType();
   string arg1();
   int arg2();
+  int lineNumber();
   void endParsing();
 
 private:
   string currentCommand;
+  int currentLine; // line number of currentCommand in the file, from 1
   ifstream vmfile;
+  istream *input; // &vmfile, or the stream given to the constructor
 
   void removeSpaces(string &str);
   string removeLeadingSpaces(string str);
@@ -0,0 +1,174 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "Profile.h"
+
+using namespace std;
+
+// @input mapFileName: *.prof.map written by CodeWriter in profiling mode
+// @input dumpFileName: RAM dump of the run, one "<address> <value>" per line
+//   (any non-digit characters are separators, e.g. "RAM[12288]: 42")
+// read the counters of the map from the RAM dump
+bool Profile::loadCounters(string mapFileName, string dumpFileName) {
+  ifstream mapFile(mapFileName);
+  ifstream dumpFile(dumpFileName);
+  if (!mapFile.is_open()) {
+    cout << "Error: cannot open profiling map '" << mapFileName << "'." << endl;
+    return false;
+  }
+  if (!dumpFile.is_open()) {
+    cout << "Error: cannot open RAM dump '" << dumpFileName << "'." << endl;
+    return false;
+  }
+
+  unordered_map<long, long> ram;
+  string line;
+  while (getline(dumpFile, line)) {
+    vector<long> numbers;
+    string number;
+    for (char c : line + " ") {
+      if (isdigit(c) || (c == '-' && number.empty())) {
+        number += c;
+      } else if (!number.empty()) {
+        if (number != "-") numbers.push_back(stol(number));
+        number = "";
+      }
+    }
+    if (numbers.size() >= 2) {
+      ram[numbers.front()] = numbers.back() & 0xFFFF; // unsigned 16-bit words
+    }
+  }
+
+  while (getline(mapFile, line)) {
+    if (line.empty() || line.substr(0, 2) == "//") continue;
+    istringstream fields(line);
+    long address;
+    string kind, name;
+    fields >> address >> kind >> name;
+    // a counter is two words: low at address, high at address + 1
+    long count = (ram.count(address) ? ram[address] : 0) + 65536 * (ram.count(address + 1) ? ram[address + 1] : 0);
+    // an if-goto has two counters, kept together as one "branch" entry
+    if (kind == "taken") {
+      getEntry("branch", name).count = count;
+    } else if (kind == "nottaken") {
+      getEntry("branch", name).notTaken = count;
+    } else {
+      getEntry(kind, name).count = count;
+    }
+  }
+  findHotThresholds();
+  return true;
+}
+
+// @input profileFileName: a report printed by printReport()
+// read "<kind> <name> <count>" lines ("branch <site> <taken> <not taken>")
+bool Profile::load(string profileFileName) {
+  ifstream profileFile(profileFileName);
+  if (!profileFile.is_open()) {
+    cout << "Error: cannot open profile '" << profileFileName << "'." << endl;
+    return false;
+  }
+  string line;
+  int lineNumber = 0;
+  while (getline(profileFile, line)) {
+    lineNumber++;
+    if (line.empty() || line.substr(0, 2) == "//") continue;
+    istringstream fields(line);
+    string kind, name;
+    long count = -1, notTaken = 0;
+    fields >> kind >> name >> count;
+    if (kind == "branch") fields >> notTaken;
+    if (name.empty() || count < 0) {
+      cout << "Error: " << profileFileName << ":" << lineNumber << ": expected '<kind> <name> <count>'." << endl;
+      return false;
+    }
+    Entry &entry = getEntry(kind, name);
+    entry.count = count;
+    entry.notTaken = notTaken;
+  }
+  findHotThresholds();
+  return true;
+}
+
+// print "<kind> <name> <count>" per counter, hottest first within each kind
+void Profile::printReport(ostream &out) {
+  vector<pair<string, string>> sections = {
+    {"function", "hot functions (entries)"},
+    {"call", "hot call sites (calls)"},
+    {"label", "hot loops (label arrivals)"},
+    {"branch", "hot branches (taken, not taken)"}
+  };
+  for (auto &section : sections) {
+    vector<Entry> sorted;
+    for (auto &entry : entries) {
+      if (entry.kind == section.first) sorted.push_back(entry);
+    }
+    stable_sort(sorted.begin(), sorted.end(), [](const Entry &a, const Entry &b) {
+      return a.count + a.notTaken > b.count + b.notTaken;
+    });
+    out << "// " << section.second << "\n";
+    for (auto &entry : sorted) {
+      out << entry.kind << " " << entry.name << " " << entry.count;
+      if (entry.kind == "branch") out << " " << entry.notTaken;
+      out << "\n";
+    }
+  }
+}
+
+// @return the count of a function, call site, label or taken branch,
+//   -1 if it is not in the profile
+long Profile::getCount(string kind, string name) {
+  Entry *entry = findEntry(kind, name);
+  return entry == nullptr ? -1 : entry->count;
+}
+
+// @return how many times the if-goto at site didn't jump, -1 if unknown
+long Profile::getNotTaken(string site) {
+  Entry *entry = findEntry("branch", site);
+  return entry == nullptr ? -1 : entry->notTaken;
+}
+
+// whether the entry is among the hottest ones that together make up 99%
+// of all the counts of its kind
+bool Profile::isHot(string kind, string name) {
+  long count = getCount(kind, name);
+  auto threshold = hotThreshold.find(kind);
+  return count > 0 && threshold != hotThreshold.end() && count >= threshold->second;
+}
+
+
+//--------Prvate--------
+
+Profile::Entry &Profile::getEntry(string kind, string name) {
+  Entry *entry = findEntry(kind, name);
+  if (entry != nullptr) return *entry;
+  index[kind + " " + name] = entries.size();
+  entries.push_back({kind, name, 0, 0});
+  return entries.back();
+}
+
+Profile::Entry *Profile::findEntry(string kind, string name) {
+  auto found = index.find(kind + " " + name);
+  return found == index.end() ? nullptr : &entries[found->second];
+}
+
+void Profile::findHotThresholds() {
+  map<string, vector<long>> counts;
+  map<string, long> totals;
+  for (auto &entry : entries) {
+    counts[entry.kind].push_back(entry.count);
+    totals[entry.kind] += entry.count;
+  }
+  for (auto &[kind, kindCounts] : counts) {
+    sort(kindCounts.rbegin(), kindCounts.rend());
+    long covered = 0;
+    hotThreshold[kind] = 1;
+    for (long count : kindCounts) {
+      hotThreshold[kind] = max(count, 1L);
+      covered += count;
+      if (covered * 100 >= totals[kind] * 99) break;
+    }
+  }
+}
@@ -0,0 +1,38 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <ostream>
+
+using namespace std;
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+// execution counts of a profiled run (see CodeWriter::setProfiling)
+class Profile {
+public:
+  bool loadCounters(string mapFileName, string dumpFileName);
+  bool load(string profileFileName);
+  void printReport(ostream &out);
+  long getCount(string kind, string name);
+  long getNotTaken(string site);
+  bool isHot(string kind, string name);
+
+private:
+  struct Entry {
+    string kind; // "function", "call", "label" or "branch"
+    string name;
+    long count; // entries, calls, arrivals or taken branches
+    long notTaken; // not taken branches (kind "branch" only)
+  };
+  vector<Entry> entries;
+  unordered_map<string, size_t> index; // "<kind> <name>" -> position in entries
+  map<string, long> hotThreshold; // minimum count of hot entries per kind
+
+  Entry &getEntry(string kind, string name);
+  Entry *findEntry(string kind, string name);
+  void findHotThresholds();
+};
+
+#endif
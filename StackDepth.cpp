@@ -0,0 +1,169 @@
+#include <algorithm>
+
+#include "StackDepth.h"
+
+using namespace std;
+
+// @input commands: one function (starting with C_FUNCTION) or top-level code
+// @input fileName: VM file of the commands, for the error messages
+StackDepth::StackDepth(vector<VMCommand> &commands, string fileName) : commands(commands) {
+  this->fileName = fileName;
+}
+
+// compute the depths and check them
+// @return false if there are errors (see getErrors)
+bool StackDepth::verify() {
+  int size = commands.size();
+  for (int i = 0; i < size; i++) {
+    if (commands[i].type != "C_LABEL") continue;
+    if (labels.count(commands[i].arg1)) {
+      addError(i, "label " + commands[i].arg1 + " is defined twice");
+    }
+    labels[commands[i].arg1] = i;
+  }
+
+  depths.assign(size, UNREACHED);
+  if (size == 0) return true;
+  depths[0] = 0;
+  vector<int> toVisit = {0};
+  while (!toVisit.empty()) {
+    int index = toVisit.back();
+    toVisit.pop_back();
+    VMCommand &command = commands[index];
+    int depth = depths[index];
+
+    int pops = getPops(command);
+    if (depth < pops) {
+      addError(index, "stack underflow: " + getName(command) + " needs " +
+               to_string(pops) + " but the stack has " + to_string(depth));
+      continue;
+    }
+    if (command.type == "C_RETURN" && depth != 1) {
+      addError(index, "return with " + to_string(depth) + " values on the stack instead of 1");
+      continue;
+    }
+    if ((command.type == "C_GOTO" || command.type == "C_IF" || command.type == "C_IFNOT") &&
+        !labels.count(command.arg1)) {
+      addError(index, "unknown label " + command.arg1);
+      continue;
+    }
+
+    int after = depth - pops + getPushes(command);
+    for (int successor : getSuccessors(index)) {
+      if (depths[successor] == UNREACHED) {
+        depths[successor] = after;
+        toVisit.push_back(successor);
+      } else if (depths[successor] != after) {
+        addError(successor, "stack depth " + to_string(depths[successor]) + " at label " +
+                 commands[successor].arg1 + ", but " + to_string(after) + " coming from line " +
+                 to_string(command.line));
+      }
+    }
+  }
+  return errors.empty();
+}
+
+// @return "Error: <file>.vm:<line>: <message>" for every error found by verify
+vector<string> StackDepth::getErrors() {
+  return errors;
+}
+
+// clear the clearsSlot flag of the pops whose slot is pushed to again on
+// every path. reach[i] = the least, over the paths from command i, of the
+// highest depth after a command on the path (a call gets to depth + 5 with
+// its frame, a return leaves everything above the caller's stack unused)
+// @require verify() returned true
+void StackDepth::elideClears() {
+  int size = commands.size();
+  vector<int> reach(size, 0);
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = size - 1; i >= 0; i--) {
+      if (depths[i] == UNREACHED) continue;
+      VMCommand &command = commands[i];
+      int own = depths[i] - getPops(command) + getPushes(command);
+      if (command.type == "C_CALL") own = depths[i] + 5;
+      if (command.type == "C_RETURN") own = UNBOUNDED;
+      int updated = max(own, getNextReach(i, reach));
+      if (updated != reach[i]) {
+        reach[i] = updated;
+        changed = true;
+      }
+    }
+  }
+
+  for (int i = 0; i < size; i++) {
+    VMCommand &command = commands[i];
+    if (depths[i] == UNREACHED || getPops(command) <= getPushes(command)) continue;
+    if (command.type == "C_RETURN") {
+      command.clearsSlot = false;
+      continue;
+    }
+    // the slot left free by the command
+    int slot = depths[i] - getPops(command) + getPushes(command);
+    if (getNextReach(i, reach) > slot) command.clearsSlot = false;
+  }
+}
+
+
+//--------Prvate--------
+
+// @return the commands that can run after commands[index]
+vector<int> StackDepth::getSuccessors(int index) {
+  VMCommand &command = commands[index];
+  vector<int> successors;
+  bool jumps = (command.type == "C_GOTO" || command.type == "C_IF" || command.type == "C_IFNOT");
+  if (jumps && labels.count(command.arg1)) {
+    successors.push_back(labels[command.arg1]);
+  }
+  bool fallsThrough = (command.type != "C_GOTO" && command.type != "C_RETURN");
+  if (fallsThrough && index + 1 < (int) commands.size()) {
+    successors.push_back(index + 1);
+  }
+  return successors;
+}
+
+// @return the least reach of the commands that can run after commands[index],
+//   0 if it can fall off the end (nothing is pushed after that)
+int StackDepth::getNextReach(int index, vector<int> &reach) {
+  VMCommand &command = commands[index];
+  int next = UNBOUNDED;
+  bool fallsThrough = (command.type != "C_GOTO" && command.type != "C_RETURN");
+  if (fallsThrough && index + 1 == (int) commands.size()) next = 0;
+  for (int successor : getSuccessors(index)) {
+    next = min(next, reach[successor]);
+  }
+  return next;
+}
+
+// @return how many values a command takes from the stack
+int StackDepth::getPops(VMCommand &command) {
+  string type = command.type;
+  if (type == "C_POP" || type == "C_IF" || type == "C_IFNOT" || type == "C_RETURN") return 1;
+  if (type == "C_CALL") return command.arg2;
+  if (type == "C_ARITHMETIC") {
+    return (command.arg1 == "neg" || command.arg1 == "not") ? 1 : 2;
+  }
+  return 0;
+}
+
+// @return how many values a command leaves on the stack
+int StackDepth::getPushes(VMCommand &command) {
+  string type = command.type;
+  if (type == "C_PUSH" || type == "C_CALL" || type == "C_ARITHMETIC") return 1;
+  return 0;
+}
+
+// @return the VM name of a command that pops, for the error messages
+string StackDepth::getName(VMCommand &command) {
+  if (command.type == "C_ARITHMETIC") return command.arg1;
+  if (command.type == "C_POP") return "pop";
+  if (command.type == "C_CALL") return "call " + command.arg1;
+  if (command.type == "C_RETURN") return "return";
+  return "if-goto";
+}
+
+void StackDepth::addError(int index, string message) {
+  errors.push_back("Error: " + fileName + ".vm:" + to_string(commands[index].line) + ": " + message);
+}
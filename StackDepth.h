@@ -0,0 +1,42 @@
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "VMCommand.h"
+
+using namespace std;
+
+#ifndef STACKDEPTH_H
+#define STACKDEPTH_H
+
+// computes the operand stack depth before every command of one function
+// (0 after "function f k") and checks it: the same depth on every path into
+// a label, no pop from an empty stack, exactly one value at a return.
+// Then finds the pops whose slot is written again on every path anyway, so
+// that setting it to 0 can be left out.
+class StackDepth {
+public:
+  StackDepth(vector<VMCommand> &commands, string fileName);
+  bool verify();
+  vector<string> getErrors();
+  void elideClears();
+
+  static constexpr int UNREACHED = -1;
+  static constexpr int UNBOUNDED = 1 << 30; // reach of a return
+
+private:
+  vector<VMCommand> &commands;
+  string fileName; // for the error messages
+  unordered_map<string, int> labels; // label -> index of its C_LABEL
+  vector<int> depths; // depth before each command, UNREACHED if none
+  vector<string> errors;
+
+  vector<int> getSuccessors(int index);
+  int getNextReach(int index, vector<int> &reach);
+  int getPops(VMCommand &command);
+  int getPushes(VMCommand &command);
+  string getName(VMCommand &command);
+  void addError(int index, string message);
+};
+
+#endif
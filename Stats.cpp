@@ -0,0 +1,215 @@
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "Stats.h"
+
+using namespace std;
+
+// number of heap allocations made by the whole program
+static atomic<long> allocationCount(0);
+
+// count every allocation, otherwise behave like the default operator new;
+// all the forms of new / delete are replaced, so that they all use malloc / free
+static void *allocate(size_t size, size_t alignment) {
+  allocationCount++;
+  if (size == 0) size = 1;
+  if (alignment <= alignof(max_align_t)) return malloc(size);
+  return aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+void *operator new(size_t size) {
+  void *p = allocate(size, 0);
+  if (p == nullptr) throw bad_alloc();
+  return p;
+}
+
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+
+void *operator new(size_t size, const nothrow_t &) noexcept {
+  return allocate(size, 0);
+}
+
+void *operator new[](size_t size, const nothrow_t &) noexcept {
+  return allocate(size, 0);
+}
+
+void *operator new(size_t size, align_val_t alignment) {
+  void *p = allocate(size, (size_t) alignment);
+  if (p == nullptr) throw bad_alloc();
+  return p;
+}
+
+void *operator new[](size_t size, align_val_t alignment) {
+  return operator new(size, alignment);
+}
+
+void *operator new(size_t size, align_val_t alignment, const nothrow_t &) noexcept {
+  return allocate(size, (size_t) alignment);
+}
+
+void *operator new[](size_t size, align_val_t alignment, const nothrow_t &) noexcept {
+  return allocate(size, (size_t) alignment);
+}
+
+void operator delete(void *p) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, const nothrow_t &) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, const nothrow_t &) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, align_val_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, align_val_t) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, size_t, align_val_t) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, size_t, align_val_t) noexcept {
+  free(p);
+}
+
+void operator delete(void *p, align_val_t, const nothrow_t &) noexcept {
+  free(p);
+}
+
+void operator delete[](void *p, align_val_t, const nothrow_t &) noexcept {
+  free(p);
+}
+
+Stats::Stats() {
+  this->allocationsAtStart = allocationCount;
+}
+
+// start (or resume) the timer of a phase
+void Stats::startTimer(string phase) {
+  if (elapsed.find(phase) == elapsed.end()) {
+    phaseOrder.push_back(phase);
+    elapsed[phase] = chrono::steady_clock::duration::zero();
+  }
+  started[phase] = chrono::steady_clock::now();
+}
+
+// stop the timer of a phase and add the time since startTimer()
+void Stats::stopTimer(string phase) {
+  elapsed[phase] += chrono::steady_clock::now() - started[phase];
+}
+
+// @input commandType: "C_PUSH", "C_ARITHMETIC", etc.
+void Stats::countCommand(string commandType) {
+  addType(commandType);
+  commands[commandType]++;
+}
+
+// record the assembly emitted for one command of the given type
+void Stats::countEmitted(string commandType, int instructions, int bytes) {
+  addType(commandType);
+  this->instructions[commandType] += instructions;
+  this->bytes[commandType] += bytes;
+}
+
+// add the timers and counters of other (e.g. collected by another thread)
+void Stats::add(Stats &other) {
+  for (auto &phase : other.phaseOrder) {
+    if (elapsed.find(phase) == elapsed.end()) {
+      phaseOrder.push_back(phase);
+      elapsed[phase] = chrono::steady_clock::duration::zero();
+    }
+    elapsed[phase] += other.elapsed[phase];
+  }
+  for (auto &type : other.typeOrder) {
+    addType(type);
+    commands[type] += other.commands[type];
+    instructions[type] += other.instructions[type];
+    bytes[type] += other.bytes[type];
+  }
+}
+
+// print the stats as human-readable tables
+void Stats::printTable(ostream &out) {
+  double totalTime = 0;
+  out << "\n" << left << setw(28) << "phase" << right << setw(12) << "time (ms)" << "\n";
+  for (auto &phase : phaseOrder) {
+    out << left << setw(28) << phase << right << setw(12) << fixed << setprecision(3) << getMilliseconds(phase) << "\n";
+    totalTime += getMilliseconds(phase);
+  }
+  out << left << setw(28) << "total" << right << setw(12) << totalTime << "\n";
+
+  long totalCommands = 0, totalInstructions = 0, totalBytes = 0;
+  out << "\n" << left << setw(16) << "command type" << right << setw(12) << "commands"
+      << setw(14) << "instructions" << setw(12) << "bytes" << "\n";
+  for (auto &type : typeOrder) {
+    out << left << setw(16) << type << right << setw(12) << commands[type]
+        << setw(14) << instructions[type] << setw(12) << bytes[type] << "\n";
+    totalCommands += commands[type];
+    totalInstructions += instructions[type];
+    totalBytes += bytes[type];
+  }
+  out << left << setw(16) << "total" << right << setw(12) << totalCommands
+      << setw(14) << totalInstructions << setw(12) << totalBytes << "\n";
+
+  out << "\nallocations: " << getAllocations() << "\n";
+}
+
+// print the stats as a single JSON object
+void Stats::printJSON(ostream &out) {
+  out << "{\n  \"phases\": {";
+  for (size_t i = 0; i < phaseOrder.size(); i++) {
+    out << (i == 0 ? "\n" : ",\n") << "    \"" << phaseOrder[i] << "\": "
+        << fixed << setprecision(3) << getMilliseconds(phaseOrder[i]);
+  }
+  out << "\n  },\n  \"commands\": {";
+  for (size_t i = 0; i < typeOrder.size(); i++) {
+    string type = typeOrder[i];
+    out << (i == 0 ? "\n" : ",\n") << "    \"" << type << "\": {"
+        << "\"count\": " << commands[type] << ", "
+        << "\"instructions\": " << instructions[type] << ", "
+        << "\"bytes\": " << bytes[type] << "}";
+  }
+  out << "\n  },\n  \"allocations\": " << getAllocations() << "\n}\n";
+}
+
+
+//--------Prvate--------
+
+void Stats::addType(string commandType) {
+  if (commands.find(commandType) == commands.end()) {
+    typeOrder.push_back(commandType);
+    commands[commandType] = 0;
+  }
+}
+
+double Stats::getMilliseconds(string phase) {
+  return chrono::duration<double, milli>(elapsed[phase]).count();
+}
+
+long Stats::getAllocations() {
+  return allocationCount - allocationsAtStart;
+}
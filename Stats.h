@@ -0,0 +1,41 @@
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <ostream>
+
+using namespace std;
+
+#ifndef STATS_H
+#define STATS_H
+
+// self-instrumentation of the translator (--stats)
+// collects time per phase, VM commands per type, emitted instructions
+// and bytes per command type, and heap allocations
+class Stats {
+public:
+  Stats();
+  void startTimer(string phase);
+  void stopTimer(string phase);
+  void countCommand(string commandType);
+  void countEmitted(string commandType, int instructions, int bytes);
+  void add(Stats &other);
+  void printTable(ostream &out);
+  void printJSON(ostream &out);
+
+private:
+  long allocationsAtStart; // allocation count when the Stats was created
+  vector<string> phaseOrder; // phases in the order they were first timed
+  map<string, chrono::steady_clock::time_point> started;
+  map<string, chrono::steady_clock::duration> elapsed;
+  vector<string> typeOrder; // command types in the order they were first seen
+  map<string, long> commands; // VM commands per command type
+  map<string, long> instructions; // emitted instructions per command type
+  map<string, long> bytes; // bytes written per command type
+
+  void addType(string commandType);
+  double getMilliseconds(string phase);
+  long getAllocations();
+};
+
+#endif
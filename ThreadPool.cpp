@@ -0,0 +1,89 @@
+#include "ThreadPool.h"
+
+using namespace std;
+
+// @input numThreads: number of worker threads, 0 or 1 for none
+ThreadPool::ThreadPool(int numThreads) {
+  this->pending = 0;
+  this->stopping = false;
+  this->nextWorker = 0;
+  if (numThreads < 2) return;
+  for (int i = 0; i < numThreads; i++) {
+    workers.push_back(new Worker());
+  }
+  for (int i = 0; i < numThreads; i++) {
+    threads.push_back(thread(&ThreadPool::run, this, i));
+  }
+}
+
+// finish the submitted jobs and stop the workers
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> guard(sleepLock);
+    stopping = true;
+  }
+  wakeUp.notify_all();
+  for (auto &worker : threads) {
+    worker.join();
+  }
+  for (auto worker : workers) {
+    delete worker;
+  }
+}
+
+// run the job on one of the workers (or right now if there are none)
+void ThreadPool::submit(function<void()> job) {
+  if (workers.empty()) {
+    job();
+    return;
+  }
+  Worker *worker = workers[nextWorker];
+  nextWorker = (nextWorker + 1) % workers.size();
+  {
+    lock_guard<mutex> guard(worker->lock);
+    worker->jobs.push_back(job);
+  }
+  {
+    lock_guard<mutex> guard(sleepLock);
+    pending++;
+  }
+  wakeUp.notify_one();
+}
+
+
+//--------Prvate--------
+
+// worker loop: run jobs until the pool is destroyed and no job is left
+void ThreadPool::run(int index) {
+  while (true) {
+    function<void()> job;
+    if (takeJob(index, job)) {
+      job();
+      continue;
+    }
+    unique_lock<mutex> guard(sleepLock);
+    wakeUp.wait(guard, [this] { return pending > 0 || stopping; });
+    if (pending == 0 && stopping) return;
+  }
+}
+
+// take the newest job of worker index, else steal the oldest job of another
+bool ThreadPool::takeJob(int index, function<void()> &job) {
+  int size = workers.size();
+  for (int i = 0; i < size; i++) {
+    Worker *worker = workers[(index + i) % size];
+    lock_guard<mutex> guard(worker->lock);
+    if (worker->jobs.empty()) continue;
+    if (i == 0) {
+      job = move(worker->jobs.back());
+      worker->jobs.pop_back();
+    } else {
+      job = move(worker->jobs.front());
+      worker->jobs.pop_front();
+    }
+    lock_guard<mutex> sleepGuard(sleepLock);
+    pending--;
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,39 @@
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+using namespace std;
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// fixed set of worker threads with one job deque each: a worker runs its
+// own newest job first and, when it has none, steals the oldest job of
+// another worker. With less than 2 threads jobs run in submit().
+class ThreadPool {
+public:
+  ThreadPool(int numThreads);
+  ~ThreadPool();
+  void submit(function<void()> job);
+
+private:
+  struct Worker {
+    deque<function<void()>> jobs;
+    mutex lock;
+  };
+  vector<Worker *> workers;
+  vector<thread> threads;
+  mutex sleepLock; // guards pending and stopping
+  condition_variable wakeUp;
+  int pending; // submitted jobs that no worker has taken yet
+  bool stopping;
+  int nextWorker; // worker that gets the next submitted job
+
+  void run(int index);
+  bool takeJob(int index, function<void()> &job);
+};
+
+#endif
@@ -0,0 +1,21 @@
+#include <string>
+
+using namespace std;
+
+#ifndef VMCOMMAND_H
+#define VMCOMMAND_H
+
+// a VM command buffered by CodeWriter until its function is complete
+struct VMCommand {
+  string type; // "C_PUSH", "C_IF", etc., or "C_IFNOT" (if-goto inverted by BlockLayout)
+  string arg1;
+  int arg2;
+  string site; // name in profiles: function, label symbol, branch or call site
+  int line; // line in the VM file, 0 for commands made by the translator
+  int counter; // RAM address of the profiling counter(s), -1 if none
+  bool inlined; // C_CALL / C_RETURN: inline sequence instead of the shared routine
+  bool clearsSlot; // whether the slot a command pops is set to 0 (see StackDepth)
+  string text; // the VM command as written in the VM file, for the source map
+};
+
+#endif
@@ -4,6 +4,8 @@
 
 #include "Parser.h"
 #include "CodeWriter.h"
+#include "Stats.h"
+#include "Profile.h"
 
 using namespace std;
 namespace fs = std::filesystem;
@@ -20,91 +22,247 @@ vector<string> getVMFiles(const string &path) {
   return vmFiles;
 }
 
-int main() {
-  // get path to the VM file or directory
-  string inputPath;
-  cout << "Name of the VM file or directory containing VM files (inside vm_files/): ";
-  cin >> inputPath;
-
-  vector<string> filesToProcess;
-  bool needSysInit;
-
-  // if the inputPath starts with "vm_files/", remove it
-  if (inputPath.substr(0, inputPath.find("/")) == "vm_files") {
-    inputPath = inputPath.substr(inputPath.find("/") + 1);
+// @input inputPath: a VM file or a directory containing VM files
+// returns the VM files to process, empty (after an error message) if none
+vector<string> getInputFiles(const string &inputPath, bool &isDirectory) {
+  isDirectory = fs::is_directory(inputPath);
+  if (isDirectory) { // if inputPath is a directry, get all the VM files inside it
+    vector<string> vmFiles = getVMFiles(inputPath);
+    if (vmFiles.empty()) cout << "No .vm files found to process in '" << inputPath << "'." << endl;
+    return vmFiles;
+  }
+  // check if the file exists
+  if (!fs::exists(inputPath)) {
+    cout << "Error: File '" << inputPath << "' does not exists." << endl;
+    return {};
   }
+  return {inputPath};
+}
 
-  // construct filesToProcess
-  if (fs::is_directory("vm_files/" + inputPath)) { // if inputPath is a directry, get all the VM files inside it
-    filesToProcess = getVMFiles("vm_files/" + inputPath);
-    needSysInit = true;
-  } else { // if inputPath is a fileName
-    if (inputPath.find(".vm") == string::npos) { // if the fileName doesn't have .vm extension, add it
-      inputPath += ".vm";
+// translate the commands of one VM file (or of the standard input)
+// @input classFiles: take the file name (for static variables) from the class
+//   of each function, for the classes of a program that come in one stream
+void translate(Parser &parser, CodeWriter &writer, Stats *stats, bool classFiles) {
+  string className;
+
+  // process the VM file line by line
+  while (parser.hasNextCommand()) {
+    if (stats) stats->startTimer("parse");
+    parser.advance();
+    string commandType = parser.commandType();
+    string arg1 = parser.arg1();
+    int arg2 = parser.arg2();
+    if (stats) {
+      stats->stopTimer("parse");
+      if (commandType != "SKIP") stats->countCommand(commandType); // not blank lines and comments
     }
-    string fullPath = "vm_files/" + inputPath;
+    writer.setLineNumber(parser.lineNumber());
 
-    // check if the file exists
-    if (fs::exists(fullPath)) {
-      filesToProcess.push_back(fullPath);
-    } else {
-      cout << "Error: File '" << fullPath << "' does not exists." << endl;
-      return 1;
+    if (classFiles && commandType == "C_FUNCTION" && arg1.substr(0, arg1.find(".")) != className) {
+      className = arg1.substr(0, arg1.find("."));
+      writer.setFileName(className);
     }
-    needSysInit = false;
-  }
 
-  // if no valid .vm files found, print an error message
-  if (filesToProcess.empty()) {
-    cout << "No .vm files found to process." << endl;
-    return 1;
+    if (commandType == "C_ARITHMETIC") {
+      writer.writeArithmetic(arg1);
+    } else if (commandType == "C_PUSH") {
+      writer.writePush(arg1, arg2);
+    } else if (commandType == "C_POP") {
+      writer.writePop(arg1, arg2);
+    } else if (commandType == "C_FUNCTION") {
+      writer.writeFunction(arg1, arg2);
+    } else if (commandType == "C_CALL") {
+      writer.writeCall(arg1, arg2);
+    } else if (commandType == "C_RETURN") {
+      writer.writeReturn();
+    } else if (commandType == "C_LABEL") {
+      writer.writeLabel(arg1);
+    } else if (commandType == "C_GOTO") {
+      writer.writeGoto(arg1);
+    } else if (commandType == "C_IF") {
+      writer.writeIf(arg1);
+    }
   }
+  parser.endParsing();
+}
 
-  // initialize CodeWriter with the output filename
-  string outputFileName = inputPath.substr(0, inputPath.find(".")) + ".asm";
-  CodeWriter writer("asm_files/" + outputFileName, needSysInit);
+// translate VM files into one asm file
+// @input needSysInit: whether the bootstrap code calls Sys.init (for a directory)
+// returns false if the output can't be written or the VM code is not consistent
+bool translateFiles(CodeWriter &writer, Stats *stats, const vector<string> &vmFiles,
+                    const string &outputFileName, bool needSysInit, bool profiling) {
+  if (!writer.open(outputFileName, needSysInit)) return false;
+  writer.writeInit();
 
   // process each VM file
-  for (auto file : filesToProcess) {
+  for (auto file : vmFiles) {
     cout << "Processing file: " << file << endl;
-
     writer.setFileName(fs::path(file).stem().string());
     Parser parser(file);
+    translate(parser, writer, stats, false);
+  }
 
-    // process the VM file line by line
-    while (parser.hasNextCommand()) {
-      parser.advance();
-      string commandType = parser.commandType();
-      if (commandType == "C_ARITHMETIC") {
-        writer.writeArithmetic(parser.arg1());
-      } else if (commandType == "C_PUSH") {
-        writer.writePush(parser.arg1(), parser.arg2());
-      } else if (commandType == "C_POP") {
-        writer.writePop(parser.arg1(), parser.arg2());
-      } else if (commandType == "C_FUNCTION") {
-        writer.writeFunction(parser.arg1(), parser.arg2());
-      } else if (commandType == "C_CALL") {
-        writer.writeCall(parser.arg1(), parser.arg2());
-      } else if (commandType == "C_RETURN") {
-        writer.writeReturn();
-      } else if (commandType == "C_LABEL") {
-        writer.writeLabel(parser.arg1());
-      } else if (commandType == "C_GOTO") {
-        writer.writeGoto(parser.arg1());
-      } else if (commandType == "C_IF") {
-        writer.writeIf(parser.arg1());
-      } else {
-        continue;
+  // finish code-writer
+  writer.endWriting();
+  if (writer.hasErrors()) {
+    cout << "Error: the VM code is not consistent, " << outputFileName << " is not usable." << endl;
+    return false;
+  }
+
+  cout << "VM translation completed. Output file: " << outputFileName << endl;
+  if (profiling) {
+    cout << "Profiling counters: RAM[" << writer.getProfileBase() << ".." << CodeWriter::PROFILE_END - 1 << "], see "
+         << fs::path(outputFileName).replace_extension(".prof.map").string() << endl;
+  }
+  return true;
+}
+
+const string usage =
+  "Usage: program [options] <file.vm | directory>...   writes <file>.asm, <directory>/<directory>.asm\n"
+  "       program [options] [--init] -                  reads VM code from stdin, writes to stdout\n"
+  "       program [options]                             asks for a name inside vm_files/\n"
+  "       program --profile-report <file.prof.map> <ram dump>\n"
+  "Options: [--stats | --stats=json] [--compact] [--source-map]\n"
+  "         [--profile-counters] [--profile <profile>] [--threads <n>]";
+
+int main(int argc, char *argv[]) {
+  // read the options: --stats prints a table, --stats=json prints JSON
+  Stats *stats = nullptr;
+  bool statsAsJSON = false;
+  bool profiling = false;
+  Profile *profile = nullptr;
+  bool compact = false;
+  bool sourceMap = false;
+  bool sourceMapOption = false; // --source-map itself, not implied by --compact
+  int threads = 0; // 0: one per hardware thread
+  bool streaming = false; // "-": from stdin to stdout
+  bool streamSysInit = false;
+  vector<string> inputPaths;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--stats" || arg == "--stats=json") {
+      stats = new Stats();
+      statsAsJSON = (arg == "--stats=json");
+    } else if (arg == "--compact") {
+      // comments are replaced by the source map
+      compact = true;
+      sourceMap = true;
+    } else if (arg == "--source-map") {
+      sourceMap = true;
+      sourceMapOption = true;
+    } else if (arg == "--profile-counters") {
+      profiling = true;
+    } else if (arg == "--profile" && i + 1 < argc) {
+      profile = new Profile();
+      if (!profile->load(argv[++i])) return 1;
+    } else if (arg == "--threads" && i + 1 < argc) {
+      threads = atoi(argv[++i]);
+      if (threads < 1) {
+        cout << "Error: --threads needs a positive number.\n" << usage << endl;
+        return 1;
       }
+    } else if (arg == "--profile-report" && i + 2 < argc) {
+      // decode the counters of a profiled run instead of translating
+      Profile profile;
+      if (!profile.loadCounters(argv[i + 1], argv[i + 2])) return 1;
+      profile.printReport(cout);
+      return 0;
+    } else if (arg == "--init") {
+      streamSysInit = true;
+    } else if (arg == "-") {
+      streaming = true;
+    } else if (arg.substr(0, 2) == "--") {
+      cout << "Error: unknown option '" << arg << "'.\n" << usage << endl;
+      return 1;
+    } else {
+      inputPaths.push_back(arg);
     }
-    parser.endParsing();
+  }
+  if (streaming && (!inputPaths.empty() || profiling || sourceMapOption)) {
+    cerr << "Error: '-' can't be used with input paths, --profile-counters or --source-map.\n" << usage << endl;
+    return 1;
   }
 
-  // finish parser and code-writer
-  writer.endWriting();
+  // one code-writer (and its threads) for all the outputs
+  CodeWriter writer(threads);
+  writer.setStats(stats);
+  writer.setProfiling(profiling);
+  writer.setProfile(profile);
+  writer.setCompact(compact);
+  writer.setSourceMap(sourceMap && !streaming);
 
-  cout << "VM translation completed. Output file: " << outputFileName << endl;
-  return 0;
+  bool succeeded = true;
+  if (streaming) {
+    // the assembly code goes to stdout function by function, messages to stderr
+    writer.open("-", streamSysInit);
+    writer.writeInit();
+    writer.setFileName("stdin"); // for top-level code
+    Parser parser(cin);
+    translate(parser, writer, stats, true);
+    writer.endWriting();
+    succeeded = !writer.hasErrors();
+  } else if (!inputPaths.empty()) {
+    // <file>.vm -> <file>.asm, <directory> -> <directory>/<directory>.asm
+    for (auto inputPath : inputPaths) {
+      bool isDirectory;
+      if (stats) stats->startTimer("scan");
+      vector<string> filesToProcess = getInputFiles(inputPath, isDirectory);
+      if (stats) stats->stopTimer("scan");
+      if (filesToProcess.empty()) {
+        succeeded = false;
+        continue;
+      }
+
+      fs::path path = fs::path(inputPath);
+      string outputFileName;
+      if (isDirectory) {
+        if (!path.has_filename()) path = path.parent_path(); // "directory/"
+        outputFileName = (path / path.filename()).string() + ".asm";
+      } else {
+        outputFileName = path.replace_extension(".asm").string();
+      }
+      if (!translateFiles(writer, stats, filesToProcess, outputFileName, isDirectory, profiling)) {
+        succeeded = false;
+      }
+    }
+  } else {
+    // get path to the VM file or directory
+    string inputPath;
+    cout << "Name of the VM file or directory containing VM files (inside vm_files/): ";
+    cin >> inputPath;
+
+    // if the inputPath starts with "vm_files/", remove it
+    if (inputPath.substr(0, inputPath.find("/")) == "vm_files") {
+      inputPath = inputPath.substr(inputPath.find("/") + 1);
+    }
+    // if the fileName doesn't have .vm extension, add it
+    if (!fs::is_directory("vm_files/" + inputPath) && inputPath.find(".vm") == string::npos) {
+      inputPath += ".vm";
+    }
+
+    bool isDirectory;
+    if (stats) stats->startTimer("scan");
+    vector<string> filesToProcess = getInputFiles("vm_files/" + inputPath, isDirectory);
+    if (stats) stats->stopTimer("scan");
+    if (filesToProcess.empty()) {
+      delete stats;
+      delete profile;
+      return 1;
+    }
+
+    // the output goes to asm_files/
+    string outputFileName = "asm_files/" + inputPath.substr(0, inputPath.find(".")) + ".asm";
+    succeeded = translateFiles(writer, stats, filesToProcess, outputFileName, isDirectory, profiling);
+  }
+
+  if (stats) {
+    ostream &report = streaming ? cerr : cout;
+    if (statsAsJSON) stats->printJSON(report);
+    else stats->printTable(report);
+    delete stats;
+  }
+  delete profile;
+  return succeeded ? 0 : 1;
 }
 
-// g++ -std=c++20 -o program CodeWriter.cpp Parser.cpp main.cpp
\ No newline at end of file
+// g++ -std=c++20 -pthread -o program CodeWriter.cpp Parser.cpp Stats.cpp Profile.cpp BlockLayout.cpp ThreadPool.cpp StackDepth.cpp main.cpp
@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+# translates the VM programs of tests/, runs them on a small Hack CPU emulator
+# and compares RAM with the expected values
+# usage: python3 tests/check.py [path to the translator, default ./program] [options...]
+import os, shutil, subprocess, sys, tempfile
+
+TESTS = os.path.dirname(os.path.abspath(__file__))
+
+# name: (RAM set before the run, expected RAM as address: value or address: [values...])
+CASES = {
+  'StackTest.vm': ({}, {0: 266, 256: [-1, 0, 0, 0, -1, 0, -1, 0, 0, -91], 266: [0, 0]}),
+  'BasicTest.vm': ({1: 300, 2: 400, 3: 3000, 4: 3010},
+                   {256: 472, 300: 10, 401: [21, 22], 3006: 36, 3012: 42, 3015: 45, 11: 510, 257: [0, 0]}),
+  'FibonacciElement': ({}, {0: 262, 261: 3}),
+  'IfGotoAtEnd.vm': ({}, {5: 35, 256: [0, 0]}),
+  'LabelClash.vm': ({}, {5: 3}),
+}
+
+COMP = {
+  '0': lambda a, d, m: 0, '1': lambda a, d, m: 1, '-1': lambda a, d, m: -1,
+  'D': lambda a, d, m: d, 'A': lambda a, d, m: a, 'M': lambda a, d, m: m,
+  '!D': lambda a, d, m: ~d, '!A': lambda a, d, m: ~a, '!M': lambda a, d, m: ~m,
+  '-D': lambda a, d, m: -d, '-A': lambda a, d, m: -a, '-M': lambda a, d, m: -m,
+  'D+1': lambda a, d, m: d + 1, 'A+1': lambda a, d, m: a + 1, 'M+1': lambda a, d, m: m + 1,
+  'D-1': lambda a, d, m: d - 1, 'A-1': lambda a, d, m: a - 1, 'M-1': lambda a, d, m: m - 1,
+  'D+A': lambda a, d, m: d + a, 'D+M': lambda a, d, m: d + m,
+  'D-A': lambda a, d, m: d - a, 'D-M': lambda a, d, m: d - m,
+  'A-D': lambda a, d, m: a - d, 'M-D': lambda a, d, m: m - d,
+  'D&A': lambda a, d, m: d & a, 'D&M': lambda a, d, m: d & m,
+  'D|A': lambda a, d, m: d | a, 'D|M': lambda a, d, m: d | m,
+}
+for comp in ['D+A', 'D+M', 'D&A', 'D&M', 'D|A', 'D|M']:
+  COMP[comp[2] + comp[1] + comp[0]] = COMP[comp]
+JUMP = {'': lambda v: False, 'JGT': lambda v: v > 0, 'JEQ': lambda v: v == 0, 'JGE': lambda v: v >= 0,
+        'JLT': lambda v: v < 0, 'JNE': lambda v: v != 0, 'JLE': lambda v: v <= 0, 'JMP': lambda v: True}
+
+
+def signed(x):
+  x &= 0xFFFF
+  return x - 0x10000 if x & 0x8000 else x
+
+
+# @return the program as ('A', value) / ('C', dest, comp, jump) instructions, and the symbols
+def assemble(text):
+  symbols = {'SP': 0, 'LCL': 1, 'ARG': 2, 'THIS': 3, 'THAT': 4, 'SCREEN': 16384, 'KBD': 24576}
+  symbols.update({'R%d' % i: i for i in range(16)})
+  lines = []
+  for line in text.split('\n'):
+    line = line.split('//')[0].replace(' ', '').strip()
+    if line.startswith('('):
+      if line[1:-1] in symbols: raise Exception('label defined twice: ' + line)
+      symbols[line[1:-1]] = len(lines)
+    elif line:
+      lines.append(line)
+  program = []
+  variable = 16
+  for line in lines:
+    if line.startswith('@'):
+      name = line[1:]
+      if not name.isdigit() and name not in symbols:
+        symbols[name] = variable
+        variable += 1
+      program.append(('A', int(name) if name.isdigit() else symbols[name]))
+    else:
+      dest, comp, jump = '', line, ''
+      if '=' in comp: dest, comp = comp.split('=', 1)
+      if ';' in comp: comp, jump = comp.split(';', 1)
+      program.append(('C', dest, COMP[comp], JUMP[jump]))
+  return program, symbols
+
+
+# run until the end loop of the translator or of Sys.init (label WHILE)
+def run(text, ram, maxSteps=10000000):
+  program, symbols = assemble(text)
+  ends = [address for name, address in symbols.items() if name == 'END' or name.endswith('Sys.init.WHILE')]
+  a = d = pc = 0
+  for step in range(maxSteps):
+    if pc >= len(program) or pc in ends: return
+    instruction = program[pc]
+    if instruction[0] == 'A':
+      a = instruction[1]
+      pc += 1
+      continue
+    _, dest, comp, jump = instruction
+    value = signed(comp(signed(a), signed(d), signed(ram[a & 0x7FFF])))
+    if 'M' in dest: ram[a & 0x7FFF] = value & 0xFFFF
+    nextPc = (a & 0x7FFF) if jump(value) else pc + 1
+    if 'D' in dest: d = value & 0xFFFF
+    if 'A' in dest: a = value & 0xFFFF
+    pc = nextPc
+  raise Exception('no end after %d steps' % maxSteps)
+
+
+def check(translator, options, name, init, expected):
+  with tempfile.TemporaryDirectory() as work:
+    source = os.path.join(TESTS, name)
+    target = os.path.join(work, name)
+    if os.path.isdir(source):
+      shutil.copytree(source, target)
+      output = os.path.join(target, name + '.asm')
+    else:
+      shutil.copy(source, target)
+      output = target[:-3] + '.asm'
+    result = subprocess.run([translator] + options + [target], capture_output=True, text=True)
+    if result.returncode != 0:
+      return result.stdout + result.stderr
+    ram = [0] * 32768
+    for address, value in init.items(): ram[address] = value & 0xFFFF
+    try:
+      run(open(output).read(), ram)
+    except Exception as error:
+      return str(error)
+  failures = []
+  for address, values in expected.items():
+    values = values if isinstance(values, list) else [values]
+    got = [signed(ram[address + i]) for i in range(len(values))]
+    if got != values:
+      failures.append('RAM[%d..] = %s, expected %s' % (address, got, values))
+  return '; '.join(failures)
+
+
+def main():
+  translator = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else 'program')
+  options = sys.argv[2:]
+  failed = 0
+  for name, (init, expected) in CASES.items():
+    error = check(translator, options, name, init, expected)
+    print(('FAIL ' + name + ': ' + error) if error else ('ok   ' + name))
+    failed += bool(error)
+  sys.exit(1 if failed else 0)
+
+
+main()